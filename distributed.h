@@ -0,0 +1,653 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <system_error>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <random>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "./ml.h"
+#include "./parallel.h"
+
+// ***---------  TRANSPORTS  ---------*** //
+
+// Point-to-point link of one process in a ring of size processes, numbered by rank. Ring all-reduce only ever sends
+// to the next rank and receives from the previous one, so that is all a transport has to provide
+struct Transport
+{
+    const size_t rank;
+    const size_t size;
+
+    Transport (size_t rank, size_t size) : rank {rank}, size {size} {};
+    virtual ~Transport () {};
+
+    // Sends send_bytes to rank + 1 while receiving receive_bytes from rank - 1. Both directions progress together,
+    // so the ring cannot deadlock however little the transport buffers
+    virtual void SendReceive (const void* send, size_t send_bytes, void* receive, size_t receive_bytes) = 0;
+};
+
+// Every rank maps one segment holding an inbox per rank, a lock-free byte ring that only the previous rank writes
+// and only the owner reads. name must be unique to the run, as a segment left behind by a crashed run is reused
+struct SharedMemoryTransport : Transport
+{
+    struct Inbox
+    {
+        alignas (64) std::atomic <size_t> head; // bytes read, written by the owner
+        alignas (64) std::atomic <size_t> tail; // bytes written, written by the previous rank
+    };
+
+    const std::string name;
+    const size_t capacity;
+    const size_t stride; // bytes per inbox, header included
+
+    char* segment;
+
+    SharedMemoryTransport (const char* name, size_t rank, size_t size, size_t capacity = 1 << 20)
+        : Transport (rank, size), name {name}, capacity {capacity}, stride {sizeof (Inbox) + capacity}
+    {
+        // Every rank creates or opens the segment; the kernel zero-fills it, so all inboxes start empty
+        const int fd = shm_open (name, O_CREAT | O_RDWR, 0600);
+        if (fd < 0) throw std::system_error (errno, std::generic_category (), "shm_open");
+
+        if (ftruncate (fd, size * stride) < 0) throw std::system_error (errno, std::generic_category (), "ftruncate");
+
+        void* p = mmap (nullptr, size * stride, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close (fd);
+
+        if (p == MAP_FAILED) throw std::system_error (errno, std::generic_category (), "mmap");
+
+        segment = (char*)p;
+    };
+
+    ~SharedMemoryTransport ()
+    {
+        munmap (segment, size * stride);
+
+        // Unlinking only removes the name, so ranks still mapping the segment are unaffected
+        if (rank == 0) shm_unlink (name.c_str ());
+    };
+
+    Inbox* __inbox (size_t r) const
+    {
+        return (Inbox*)(segment + r * stride);
+    };
+
+    void SendReceive (const void* send, size_t send_bytes, void* receive, size_t receive_bytes) override
+    {
+        Inbox* out = __inbox ((rank + 1) % size);
+        Inbox* in = __inbox (rank);
+
+        char* out_data = (char*)(out + 1);
+        char* in_data = (char*)(in + 1);
+
+        size_t sent = 0;
+        size_t received = 0;
+
+        while (sent < send_bytes || received < receive_bytes)
+        {
+            bool progress = false;
+
+            if (sent < send_bytes)
+            {
+                const size_t tail = out -> tail.load (std::memory_order_relaxed);
+                const size_t free = capacity - (tail - out -> head.load (std::memory_order_acquire));
+                const size_t offset = tail % capacity;
+                const size_t n = std::min ({free, send_bytes - sent, capacity - offset});
+
+                if (n > 0)
+                {
+                    std::memcpy (out_data + offset, (const char*)send + sent, n);
+                    out -> tail.store (tail + n, std::memory_order_release);
+                    sent += n;
+                    progress = true;
+                };
+            };
+
+            if (received < receive_bytes)
+            {
+                const size_t head = in -> head.load (std::memory_order_relaxed);
+                const size_t available = in -> tail.load (std::memory_order_acquire) - head;
+                const size_t offset = head % capacity;
+                const size_t n = std::min ({available, receive_bytes - received, capacity - offset});
+
+                if (n > 0)
+                {
+                    std::memcpy ((char*)receive + received, in_data + offset, n);
+                    in -> head.store (head + n, std::memory_order_release);
+                    received += n;
+                    progress = true;
+                };
+            };
+
+            if (!progress) std::this_thread::yield ();
+        };
+    };
+};
+
+// Unix-domain stream sockets: rank r listens on path.r, connects to the next rank and accepts the previous one
+struct SocketTransport : Transport
+{
+    int next;     // socket to rank + 1
+    int previous; // socket from rank - 1
+
+    SocketTransport (const char* path, size_t rank, size_t size)
+        : Transport (rank, size)
+    {
+        const sockaddr_un own = __address (path, rank);
+        const sockaddr_un target = __address (path, (rank + 1) % size);
+
+        const int listener = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) throw std::system_error (errno, std::generic_category (), "socket");
+
+        unlink (own.sun_path);
+
+        if (bind (listener, (const sockaddr*)&own, sizeof (own)) < 0) throw std::system_error (errno, std::generic_category (), "bind");
+        if (listen (listener, 1) < 0) throw std::system_error (errno, std::generic_category (), "listen");
+
+        // The next rank may not be listening yet
+        next = socket (AF_UNIX, SOCK_STREAM, 0);
+        while (connect (next, (const sockaddr*)&target, sizeof (target)) < 0)
+        {
+            if (errno != ENOENT && errno != ECONNREFUSED) throw std::system_error (errno, std::generic_category (), "connect");
+            std::this_thread::sleep_for (std::chrono::milliseconds (1));
+        };
+
+        previous = accept (listener, nullptr, nullptr);
+        if (previous < 0) throw std::system_error (errno, std::generic_category (), "accept");
+
+        close (listener);
+        unlink (own.sun_path);
+
+        fcntl (next, F_SETFL, O_NONBLOCK);
+        fcntl (previous, F_SETFL, O_NONBLOCK);
+    };
+
+    ~SocketTransport ()
+    {
+        close (next);
+        close (previous);
+    };
+
+    static sockaddr_un __address (const char* path, size_t rank)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+
+        const std::string name = std::string (path) + "." + std::to_string (rank);
+        std::strncpy (address.sun_path, name.c_str (), sizeof (address.sun_path) - 1);
+
+        return address;
+    };
+
+    void SendReceive (const void* send, size_t send_bytes, void* receive, size_t receive_bytes) override
+    {
+        size_t sent = 0;
+        size_t received = 0;
+
+        while (sent < send_bytes || received < receive_bytes)
+        {
+            pollfd fds [2] = {{next, POLLOUT, 0}, {previous, POLLIN, 0}};
+
+            if (sent == send_bytes) fds [0].fd = -1;
+            if (received == receive_bytes) fds [1].fd = -1;
+
+            if (poll (fds, 2, -1) < 0)
+            {
+                if (errno == EINTR) continue;
+                throw std::system_error (errno, std::generic_category (), "poll");
+            };
+
+            if (fds [0].revents & (POLLOUT | POLLERR | POLLHUP))
+            {
+                const ssize_t n = ::send (next, (const char*)send + sent, send_bytes - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno != EAGAIN) throw std::system_error (errno, std::generic_category (), "send");
+                if (n > 0) sent += n;
+            };
+
+            if (fds [1].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                const ssize_t n = recv (previous, (char*)receive + received, receive_bytes - received, 0);
+                if (n == 0) throw std::runtime_error ("SocketTransport: previous rank closed the connection");
+                if (n < 0 && errno != EAGAIN) throw std::system_error (errno, std::generic_category (), "recv");
+                if (n > 0) received += n;
+            };
+        };
+    };
+};
+
+
+// ***---------  RING ALL-REDUCE  ---------*** //
+
+// Replaces data on every rank with the elementwise sum over all ranks. The n elements are split into size chunks;
+// size - 1 reduce-scatter steps leave each rank with one fully summed chunk, and size - 1 all-gather steps circulate
+// them. Every rank sends 2 (size - 1) / size of the buffer whatever the ring size. Each chunk is summed in ring
+// order starting from a different rank, but all ranks end with identical values. scratch holds one chunk
+void RingAllReduce (Transport& transport, float* data, size_t n, float* scratch)
+{
+    const size_t P = transport.size;
+    const size_t r = transport.rank;
+
+    if (P == 1) return;
+
+    auto begin = [&] (size_t chunk) { return (chunk % P) * n / P; };
+    auto length = [&] (size_t chunk) { return (chunk % P + 1) * n / P - begin (chunk); };
+
+    // Reduce-scatter: at step t send chunk r - t, receive and accumulate chunk r - t - 1
+    for (size_t t = 0; t + 1 < P; t++)
+    {
+        const size_t out = r + P - t;
+        const size_t in = r + 2 * P - t - 1;
+
+        transport.SendReceive (data + begin (out), length (out) * sizeof (float), scratch, length (in) * sizeof (float));
+
+        float* __restrict target = data + begin (in);
+
+        #pragma omp simd
+        for (size_t i = 0; i < length (in); i++)
+        {
+            target [i] += scratch [i];
+        };
+    };
+
+    // All-gather: at step t send chunk r + 1 - t, now complete, and receive chunk r - t
+    for (size_t t = 0; t + 1 < P; t++)
+    {
+        const size_t out = r + 1 + P - t;
+        const size_t in = r + P - t;
+
+        transport.SendReceive (data + begin (out), length (out) * sizeof (float), scratch, length (in) * sizeof (float));
+
+        std::copy (scratch, scratch + length (in), data + begin (in));
+    };
+};
+
+
+// Ring all-gather of equal-sized blobs: on entry slot rank of data (bytes each) holds this rank's blob, on return
+// every slot holds the blob of the matching rank
+void RingAllGather (Transport& transport, char* data, size_t bytes)
+{
+    const size_t P = transport.size;
+    const size_t r = transport.rank;
+
+    // At step t pass on the blob of rank r - t and receive that of rank r - t - 1
+    for (size_t t = 0; t + 1 < P; t++)
+    {
+        const size_t out = (r + P - t) % P;
+        const size_t in = (r + 2 * P - t - 1) % P;
+
+        transport.SendReceive (data + out * bytes, bytes, data + in * bytes, bytes);
+    };
+};
+
+
+// ***---------  GRADIENT COMPRESSION  ---------*** //
+
+// Lossy encoding of a block of gradients for exchange. Compressed blocks have a fixed size for a given n, so they are
+// all-gathered rather than reduced, and every rank decodes and sums all of them in rank order, so the sums agree.
+// All-gathering costs each rank (P - 1) * Bytes (n) against 2 (P - 1) / P * 4n for an uncompressed ring all-reduce,
+// so the saving shrinks as 1 / P: about 8 / P for 8-bit levels and 100 / P for 1% top-k. DistributedTrainer
+// all-reduces a layer uncompressed where compressing would not save bytes
+struct Compressor
+{
+    virtual ~Compressor () {};
+
+    // Size in bytes of the compressed form of n values
+    virtual size_t Bytes (size_t n) const = 0;
+
+    // Floats of state the compressor keeps per block between calls, zero initialised by the caller
+    virtual size_t StateSize (size_t n) const
+    {
+        return 0;
+    };
+
+    virtual void Compress (const float* data, size_t n, float* state, char* payload) = 0;
+
+    // Adds the decoded values to sum
+    virtual void Decompress (const char* payload, size_t n, float* sum) const = 0;
+};
+
+// Sends only the k largest magnitudes, as (index, value) pairs, with k = density * n. What is left out is kept as a
+// residual and added to the next step's gradients (error feedback), so every gradient is applied eventually
+struct TopKCompressor : Compressor
+{
+    const float density;
+
+    uint32_t* order = nullptr; // candidate indices, reused between calls
+    size_t capacity = 0;
+
+    TopKCompressor (float density) : density {density} {};
+
+    ~TopKCompressor ()
+    {
+        delete [] order;
+    };
+
+    size_t K (size_t n) const
+    {
+        return std::min (n, std::max ((size_t)1, (size_t)(density * n)));
+    };
+
+    size_t Bytes (size_t n) const override
+    {
+        return K (n) * (sizeof (uint32_t) + sizeof (float));
+    };
+
+    size_t StateSize (size_t n) const override
+    {
+        return n;
+    };
+
+    void Compress (const float* data, size_t n, float* residuals, char* payload) override
+    {
+        if (n > capacity)
+        {
+            delete [] order;
+            order = new uint32_t [n];
+            capacity = n;
+        };
+
+        // Residuals become the full error-corrected gradients, then lose the entries that are sent
+        for (size_t i = 0; i < n; i++)
+        {
+            residuals [i] += data [i];
+            order [i] = i;
+        };
+
+        const size_t k = K (n);
+
+        std::nth_element (order, order + k - 1, order + n, [&] (uint32_t a, uint32_t b) 
+        { 
+            return std::fabs (residuals [a]) > std::fabs (residuals [b]); 
+        });
+
+        uint32_t* indices = (uint32_t*)payload;
+        float* values = (float*)(indices + k);
+
+        for (size_t i = 0; i < k; i++)
+        {
+            indices [i] = order [i];
+            values [i] = residuals [order [i]];
+            residuals [order [i]] = 0.0;
+        };
+    };
+
+    void Decompress (const char* payload, size_t n, float* sum) const override
+    {
+        const size_t k = K (n);
+        const uint32_t* indices = (const uint32_t*)payload;
+        const float* values = (const float*)(indices + k);
+
+        for (size_t i = 0; i < k; i++)
+        {
+            sum [indices [i]] += values [i];
+        };
+    };
+};
+
+// One signed byte per value on a per-block scale, rounded up or down at random in proportion to the remainder so
+// the decoded gradients are unbiased
+struct QuantisedCompressor : Compressor
+{
+    std::mt19937 generator;
+
+    QuantisedCompressor (int seed) : generator (seed) {};
+
+    size_t Bytes (size_t n) const override
+    {
+        return sizeof (float) + n;
+    };
+
+    void Compress (const float* data, size_t n, float* state, char* payload) override
+    {
+        float scale = 0.0;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            scale = std::max (scale, std::fabs (data [i]));
+        };
+
+        std::memcpy (payload, &scale, sizeof (float));
+        int8_t* levels = (int8_t*)(payload + sizeof (float));
+
+        const float step = (scale > 0) ? 127 / scale : 0;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            const float u = (generator () >> 8) * 0x1p-24f; // uniform in [0, 1)
+            // data [i] * step can round to just above 127 for the largest value, so clamp before the cast
+            levels [i] = (int8_t)std::clamp (std::floor (data [i] * step + u), -127.0f, 127.0f);
+        };
+    };
+
+    void Decompress (const char* payload, size_t n, float* sum) const override
+    {
+        float scale;
+        std::memcpy (&scale, payload, sizeof (float));
+
+        const int8_t* levels = (const int8_t*)(payload + sizeof (float));
+        const float unit = scale / 127;
+
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++)
+        {
+            sum [i] += levels [i] * unit;
+        };
+    };
+};
+
+
+// ***---------  DISTRIBUTED TRAINING  ---------*** //
+
+// Data-parallel training of one Network replica per process. Every rank builds the same network (same seed), shuffles
+// the full data set identically and takes its own contiguous slice of each minibatch; the summed gradients are
+// all-reduced so every rank applies the same update and the replicas never diverge. A communication thread reduces
+// each layer as soon as the last sample's backward pass has finished it, overlapping the exchange with the backward
+// pass of the layers below.
+template <size_t depth>
+struct DistributedTrainer
+{
+    Network <depth>& network;
+    Transport& transport;
+    Compressor* compressor;
+
+    float* scratch;
+
+    // Layers whose compressed all-gather sends fewer bytes than the plain all-reduce; the others are all-reduced
+    // uncompressed. Compression state and payloads are allocated only for these
+    bool compressed [depth] = {};
+    float* states [depth] = {};
+    char* payloads = nullptr;
+
+    // Bytes this rank has sent for gradients, and what they would have been uncompressed, in total and per layer
+    size_t sent_bytes = 0;
+    size_t uncompressed_bytes = 0;
+    size_t layer_sent_bytes [depth] = {};
+    size_t layer_uncompressed_bytes [depth] = {};
+
+    std::thread communicator;
+    SPSCQueue <int, 64> pending; // layers whose gradients are ready to reduce, -1 to stop
+    SPSCQueue <int, 64> reduced; // layers whose gradients have been reduced
+
+    // compressor, if given, encodes each layer's gradients before they are exchanged
+    DistributedTrainer (Network <depth>& network, Transport& transport, Compressor* compressor = nullptr)
+        : network {network}, transport {transport}, compressor {compressor}
+    {
+        size_t largest = 1;
+        for (int i = 0; i < depth; i++)
+        {
+            largest = std::max (largest, network.dimensions [i + 1] * (network.dimensions [i] + 1));
+        };
+
+        scratch = new float [largest / transport.size + 1];
+
+        if (compressor != nullptr)
+        {
+            size_t payload_bytes = 0;
+
+            for (int i = 0; i < depth; i++)
+            {
+                const size_t n = network.dimensions [i + 1] * (network.dimensions [i] + 1);
+
+                compressed [i] = __compressed_bytes (n) < __uncompressed_bytes (n);
+                if (!compressed [i]) continue;
+
+                states [i] = new float [compressor -> StateSize (n)]();
+                payload_bytes = std::max (payload_bytes, compressor -> Bytes (n));
+            };
+
+            payloads = new char [transport.size * payload_bytes];
+        };
+
+        communicator = std::thread ([this] () { __communicate (); });
+    };
+
+    ~DistributedTrainer ()
+    {
+        pending.Push (-1);
+        communicator.join ();
+
+        delete [] scratch;
+        delete [] payloads;
+
+        for (int i = 0; i < depth; i++)
+        {
+            delete [] states [i];
+        };
+    };
+
+    DistributedTrainer (const DistributedTrainer&) = delete;
+
+    // Bytes one rank sends to exchange n gradients: a ring all-reduce sends 2 (P - 1) chunks of n / P floats, an
+    // all-gather of compressed blocks P - 1 blocks
+    size_t __uncompressed_bytes (size_t n) const
+    {
+        return 2 * (transport.size - 1) * n * sizeof (float) / transport.size;
+    };
+
+    size_t __compressed_bytes (size_t n) const
+    {
+        return (transport.size - 1) * compressor -> Bytes (n);
+    };
+
+    // Each layer's weight gradients and bias gradients are adjacent in Network::gradients, so one reduction covers both
+    void __communicate ()
+    {
+        for (int i = pending.Pop (); i >= 0; i = pending.Pop ())
+        {
+            const size_t M = network.dimensions [i + 1];
+            const size_t N = network.dimensions [i];
+
+            const size_t n = M * (N + 1);
+            float* gradients = network.weight_gradients [i][0];
+
+            size_t sent = __uncompressed_bytes (n);
+
+            if (!compressed [i])
+            {
+                RingAllReduce (transport, gradients, n, scratch);
+            }
+            else
+            {
+                const size_t bytes = compressor -> Bytes (n);
+
+                compressor -> Compress (gradients, n, states [i], payloads + transport.rank * bytes);
+                RingAllGather (transport, payloads, bytes);
+
+                std::fill (gradients, gradients + n, 0.0f);
+
+                for (size_t r = 0; r < transport.size; r++)
+                {
+                    compressor -> Decompress (payloads + r * bytes, n, gradients);
+                };
+
+                sent = __compressed_bytes (n);
+            };
+
+            sent_bytes += sent;
+            uncompressed_bytes += __uncompressed_bytes (n);
+            layer_sent_bytes [i] += sent;
+            layer_uncompressed_bytes [i] += __uncompressed_bytes (n);
+
+            reduced.Push (i);
+        };
+    };
+
+    // Trains like GD_Minibatch with the optimiser selected by OptimiserType (args...). minibatch_size is the global
+    // batch, split over the ranks. Costs are the global minibatch losses and are the same on every rank
+    template <typename OptimiserType, typename... Args>
+    float* Train (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size, Args... args)
+    {
+        network.template SelectOptimiser <OptimiserType> (args...);
+
+        const size_t P = transport.size;
+        const size_t r = transport.rank;
+
+        const int k = set_size / minibatch_size;
+        float* costs = new float [k * network.epochs];
+        const float mean_batch = (float)1 / (float)minibatch_size;
+
+        int* indices = new int [set_size];
+        for (int i = 0; i < set_size; i++)
+        {
+            indices [i] = i;
+        };
+
+        // This rank's slice of every minibatch
+        assert (minibatch_size >= P);
+
+        const size_t begin = r * minibatch_size / P;
+        const size_t end = (r + 1) * minibatch_size / P;
+
+        for (int i = 0; i < network.epochs; i++)
+        {
+            shuffle (indices, indices + set_size, std::mt19937 (network.seed));
+            network.ResetRegulariser ();
+
+            for (int j = 0; j < k; j++)
+            {
+                network.UpdateLearningRate (j);
+                network.ResetGradients ();
+
+                const int* batch = indices + j * minibatch_size;
+                float loss = 0.0;
+
+                for (size_t b = begin; b + 1 < end; b++)
+                {
+                    loss += mean_batch * network.BackPropagateStochastic (input_set [batch [b]], expected_set [batch [b]], mean_batch);
+                };
+
+                // The last sample completes each layer in turn; hand them to the communication thread as they finish
+                float* input = input_set [batch [end - 1]];
+                network.Propagate (input);
+                loss += mean_batch * network.Backward (input, expected_set [batch [end - 1]], *network.workspace, mean_batch, [&] (int layer) { pending.Push (layer); });
+
+                for (int l = 0; l < depth; l++)
+                {
+                    reduced.Pop ();
+                };
+
+                // The communication thread is idle now, so the loss can use the ring directly
+                RingAllReduce (transport, &loss, 1, scratch);
+
+                costs [i * k + j] = loss + network.regularisation_factor * network.Regulariser ();
+
+                network.UpdateParameters ();
+            };
+        };
+
+        delete [] indices;
+
+        return costs;
+    };
+};
@@ -6,12 +6,22 @@
 #include <random> 
 #include <functional>
 #include <algorithm> // std::shuffle
+#include <typeinfo>
+#include <new> // std::align_val_t
+#include <tuple>
+#include <array>
+#include <utility> // std::index_sequence
+#include <cassert>
+#include <atomic>
 
 #if DEBUG_LEVEL == 1
     #include <string>
 #endif
 
 #include "./tensor.h"
+#include "./optimiser.h"
+#include "./vmath.h"
+#include "./parallel.h"
 
 // Implementation of std::conditional
 template <bool, typename T, typename F>
@@ -349,7 +359,8 @@ float Sigmoid (float x)
 
 float SigmoidDerivative (float x)
 {
-    return Sigmoid (x) * (1 - Sigmoid (x));
+    const float s = Sigmoid (x);
+    return s * (1 - s);
 };
 
 float TanhDerivative (float x)
@@ -409,23 +420,39 @@ void Softmax (float x [], float* y, size_t n)
     };
 };
 
-template <typename T, size_t N>
-void Softmax (const Tensor <T, N>& x, Tensor <T, N>& y) 
+// Softmax of n contiguous values, for rows that are not Tensors of their own
+template <typename T, typename Math = StandardMath>
+void SoftmaxKernel (const T* x, T* y, size_t n) 
 {
     float total = 0.0;
-    float stability = - Max <T, N> (x);
+    float max = x [0];
+
+    for (size_t i = 1; i < n; i++)
+    {
+        max = std::max (max, (float)x [i]);
+    };
 
-    for (int i = 0; i < x.length; i++)
+    // Exponentiate once, then normalise
+    for (size_t i = 0; i < n; i++)
     {
-        total += exp (x.elements [i] + stability);
+        y [i] = Math::Exp (x [i] - max);
+        total += y [i];
     };
 
-    for (int i = 0; i < x.length; i++)
+    const float scale = 1 / total;
+
+    for (size_t i = 0; i < n; i++)
     {
-        y.elements [i] = exp (x.elements [i] + stability) / total;
+        y [i] *= scale;
     };
 };
 
+template <typename T, size_t N, typename Math = StandardMath>
+void Softmax (const Tensor <T, N>& x, Tensor <T, N>& y) 
+{
+    SoftmaxKernel <T, Math> (x.elements, y.elements, x.length);
+};
+
 template <typename T, size_t N>
 void SoftmaxJacobian (const Tensor <T, N>& input, Tensor <T, 2 * N>& output)
 {
@@ -440,16 +467,153 @@ void SoftmaxJacobian (const Tensor <T, N>& input, Tensor <T, 2 * N>& output)
     };
 };
 
-float Softplus (float x);
+float Softplus (float x)
+{
+    // log (1 + e^x) without overflow for large x
+    return std::max (x, (float)0.0) + log1p (exp (- fabs (x)));
+};
+
+float GELU (float x)
+{
+    return 0.5 * x * (1 + erf (x * M_SQRT1_2));
+};
+
+float ELU (float x)
+{
+    return (x > 0) ? x : exp (x) - 1;
+};
+
+float Gaussian (float x)
+{
+    return exp (- x * x);
+};
+
+enum ActivationType { linear, relu, sigmoid, hyperbolic_tangent, gelu, elu, softplus, gaussian };
+
+// Activation value and its derivative at x, resolved at compile time so the kernels below inline it.
+// Math selects libm or the vmath.h approximations for the transcendental functions
+template <ActivationType A, typename Math = StandardMath>
+inline float ActivationWithDerivative (float x, float& derivative)
+{
+    if constexpr (A == linear)
+    {
+        derivative = 1;
+        return x;
+    }
+    else if constexpr (A == relu)
+    {
+        derivative = (x > 0) ? 1 : 0;
+        return (x > 0) ? x : 0;
+    }
+    else if constexpr (A == sigmoid)
+    {
+        const float s = 1 / (1 + Math::Exp (-x));
+        derivative = s * (1 - s);
+        return s;
+    }
+    else if constexpr (A == hyperbolic_tangent)
+    {
+        const float t = Math::Tanh (x);
+        derivative = 1 - t * t;
+        return t;
+    }
+    else if constexpr (A == gelu)
+    {
+        const float cdf = 0.5 * (1 + std::erf (x * (float)M_SQRT1_2));
+        const float pdf = Math::Exp (-0.5 * x * x) * (float)(0.5 * M_2_SQRTPI * M_SQRT1_2);
+        derivative = cdf + x * pdf;
+        return x * cdf;
+    }
+    else if constexpr (A == elu)
+    {
+        const float e = Math::Exp (std::min (x, (float)0.0));
+        derivative = (x > 0) ? 1 : e;
+        return (x > 0) ? x : e - 1;
+    }
+    else if constexpr (A == softplus)
+    {
+        const float e = Math::Exp (- std::fabs (x));
+        derivative = (x > 0) ? 1 / (1 + e) : e / (1 + e);
+        return std::max (x, (float)0.0) + Math::Log1p (e);
+    }
+    else if constexpr (A == gaussian)
+    {
+        const float e = Math::Exp (- x * x);
+        derivative = -2 * x * e;
+        return e;
+    };
+};
+
+// Applies the activation to n pre-activations, writing the activations and their derivatives in one pass
+template <ActivationType A, typename Math = StandardMath>
+void ActivationKernel (const float* __restrict x, float* __restrict activations, float* __restrict derivatives, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++)
+    {
+        activations [i] = ActivationWithDerivative <A, Math> (x [i], derivatives [i]);
+    };
+};
+
+// Forward-only variant, for when no derivatives are needed
+template <ActivationType A, typename Math = StandardMath>
+void ActivationKernel (const float* __restrict x, float* __restrict activations, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++)
+    {
+        float derivative;
+        activations [i] = ActivationWithDerivative <A, Math> (x [i], derivative);
+    };
+};
+
+// Dispatches on the activation once per array rather than once per element
+template <typename Math>
+void __activate (ActivationType type, const float* x, float* activations, float* derivatives, size_t n)
+{
+    switch (type)
+    {
+        case linear:             ActivationKernel <linear,             Math> (x, activations, derivatives, n); break;
+        case relu:               ActivationKernel <relu,               Math> (x, activations, derivatives, n); break;
+        case sigmoid:            ActivationKernel <sigmoid,            Math> (x, activations, derivatives, n); break;
+        case hyperbolic_tangent: ActivationKernel <hyperbolic_tangent, Math> (x, activations, derivatives, n); break;
+        case gelu:               ActivationKernel <gelu,               Math> (x, activations, derivatives, n); break;
+        case elu:                ActivationKernel <elu,                Math> (x, activations, derivatives, n); break;
+        case softplus:           ActivationKernel <softplus,           Math> (x, activations, derivatives, n); break;
+        case gaussian:           ActivationKernel <gaussian,           Math> (x, activations, derivatives, n); break;
+    };
+};
 
-float GELU (float x);
+template <typename Math>
+void __activate (ActivationType type, const float* x, float* activations, size_t n)
+{
+    switch (type)
+    {
+        case linear:             ActivationKernel <linear,             Math> (x, activations, n); break;
+        case relu:               ActivationKernel <relu,               Math> (x, activations, n); break;
+        case sigmoid:            ActivationKernel <sigmoid,            Math> (x, activations, n); break;
+        case hyperbolic_tangent: ActivationKernel <hyperbolic_tangent, Math> (x, activations, n); break;
+        case gelu:               ActivationKernel <gelu,               Math> (x, activations, n); break;
+        case elu:                ActivationKernel <elu,                Math> (x, activations, n); break;
+        case softplus:           ActivationKernel <softplus,           Math> (x, activations, n); break;
+        case gaussian:           ActivationKernel <gaussian,           Math> (x, activations, n); break;
+    };
+};
 
-float ELU (float x);
+void Activate (ActivationType type, const float* x, float* activations, float* derivatives, size_t n, bool fast_math = false)
+{
+    if (fast_math) __activate <FastMath>     (type, x, activations, derivatives, n);
+    else           __activate <StandardMath> (type, x, activations, derivatives, n);
+};
 
-float Gaussian (float x);
+void Activate (ActivationType type, const float* x, float* activations, size_t n, bool fast_math = false)
+{
+    if (fast_math) __activate <FastMath>     (type, x, activations, n);
+    else           __activate <StandardMath> (type, x, activations, n);
+};
 
 
-float WeightedSum (float values[], float weights [], float bias, size_t length) 
+float WeightedSum (const float values [], const float weights [], float bias, size_t length) 
 {
     float accumulated = bias;
 
@@ -461,6 +625,19 @@ float WeightedSum (float values[], float weights [], float bias, size_t length)
     return accumulated;
 };
 
+// WeightedSum over weights that Hogwild threads may be updating, each read with a relaxed atomic load
+float RelaxedWeightedSum (const float values [], const float weights [], float bias, size_t length) 
+{
+    float accumulated = bias;
+
+    for (size_t i = 0; i < length; i++) 
+    {
+        accumulated += values [i] * RelaxedLoad (weights + i);
+    };
+
+    return accumulated;
+};
+
 float MeanSquaredError (float output [], float expected [], size_t n)
 {
     float total = 0.0;
@@ -521,6 +698,20 @@ float CrossEntropy (float output [], float expected [], size_t n)
     return -total;
 };
 
+// CrossEntropy using the FastLog approximation from vmath.h
+float FastCrossEntropy (float output [], float expected [], size_t n)
+{
+    float total = 0.0;
+    float epsilon = 0.01;
+
+    for (int i = 0; i < n; i++)
+    {
+        total += expected [i] * FastLog (output [i] + epsilon);
+    };
+
+    return -total;
+};
+
 void CrossEntropyGradient (float output [], float expected [], float* gradient, size_t n) 
 {
     for (int i = 0; i < n; i++)
@@ -529,7 +720,7 @@ void CrossEntropyGradient (float output [], float expected [], float* gradient,
     };
 };
 
-template <typename T, size_t Dim, bool Chns>
+template <typename T, size_t Dim, bool Chns, typename Math = StandardMath>
 T CrossEntropy (Tensor <T, Dim + Chns>& output, const Tensor <T, Dim + Chns>& expected)
 {
     float total = 0.0;
@@ -537,7 +728,7 @@ T CrossEntropy (Tensor <T, Dim + Chns>& output, const Tensor <T, Dim + Chns>& ex
 
     for (uint i = 0; i < output.length; i++)
     {
-        total += 0.5 * expected.elements [i] * log (pow (output.elements [i], 2) + epsilon);
+        total += 0.5 * expected.elements [i] * Math::Log (output.elements [i] * output.elements [i] + epsilon);
     };
 
     return -total;
@@ -552,7 +743,7 @@ void CrossEntropyGradient (const Tensor <T, Dim + Chns>& output, const Tensor <T
     };
 };
 
-template <typename T, size_t N>
+template <typename T, size_t N, typename Math = StandardMath>
 T NegativeLogLikelyhood (const Tensor <T, N>& output, const Tensor <T, N>& expected)
 {
     float total = 0.0;
@@ -560,7 +751,7 @@ T NegativeLogLikelyhood (const Tensor <T, N>& output, const Tensor <T, N>& expec
 
     for (uint i = 0; i < output.length; i++)
     {
-        total += expected.elements [i] * log (output.elements [i] + epsilon);
+        total += expected.elements [i] * Math::Log (output.elements [i] + epsilon);
     };
 
     return -total;
@@ -652,6 +843,88 @@ void InitialiseKernel (NormalisedRandom <1>* r, Tensor <T, Dim + (2 * Chns)>* ke
     };
 };
 
+// ***---------  SAMPLING  ---------*** //
+
+// Walker's alias method (Vose's construction): O(n) to build from n weights, then O(1) per sample, one uniform
+// draw for the column and one for the coin. Weights need not be normalised
+struct AliasTable
+{
+    float* probability; // chance of keeping column i rather than taking its alias
+    size_t* alias;
+    size_t* work;       // small and large worklists for Build
+    size_t n;
+
+    AliasTable (size_t n) : n {n}
+    {
+        probability = new float [n];
+        alias = new size_t [n];
+        work = new size_t [n];
+    };
+
+    ~AliasTable ()
+    {
+        delete [] probability;
+        delete [] alias;
+        delete [] work;
+    };
+
+    AliasTable (const AliasTable&) = delete;
+
+    template <typename T>
+    void Build (const T weights [])
+    {
+        double total = 0.0;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            total += weights [i];
+        };
+
+        // Columns scaled to a mean of 1, small ones from the front of work and large ones from the back
+        size_t small = 0;
+        size_t large = n;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            probability [i] = weights [i] * n / total;
+
+            if (probability [i] < 1) work [small++] = i;
+            else                     work [--large] = i;
+        };
+
+        // Each small column is topped up from a large one, which becomes small once it drops below 1
+        while (small > 0 && large < n)
+        {
+            const size_t s = work [--small];
+            const size_t l = work [large];
+
+            alias [s] = l;
+            probability [l] -= 1 - probability [s];
+
+            if (probability [l] < 1)
+            {
+                large++;
+                work [small++] = l;
+            };
+        };
+
+        // Whatever is left is 1 up to rounding
+        for (size_t i = 0; i < small; i++) probability [work [i]] = 1;
+        for (size_t i = large; i < n; i++) probability [work [i]] = 1;
+    };
+
+    template <typename Generator>
+    size_t Sample (Generator& generator) const
+    {
+        std::uniform_int_distribution <size_t> column (0, n - 1);
+        std::uniform_real_distribution <float> coin (0.0, 1.0);
+
+        const size_t i = column (generator);
+
+        return (coin (generator) < probability [i]) ? i : alias [i];
+    };
+};
+
 // ***---------  NETWORK LAYER DEFINITIONS  ---------*** //
 
 template <typename T>
@@ -674,8 +947,64 @@ struct RecurrentLayer
 
     float learning_rate;
 
-    RecurrentLayer (size_t dimension, size_t timesteps, float learning_rate = 0.01) 
-        : timesteps {timesteps}, dimension {dimension}, learning_rate {learning_rate}
+    bool fast_math; // use the vmath.h approximations for tanh, softmax and the loss
+
+    // Batch buffers, laid out [batch][timesteps][dimension] like the inputs, so timestep i of every sequence is a
+    // matrix with a row stride of timesteps * dimension. Grown by Reserve, never shrunk
+    size_t capacity = 0;
+
+    T* batch_x             = nullptr;
+    T* batch_activations   = nullptr;
+    T* batch_outputs       = nullptr;
+    T* batch_probabilities = nullptr;
+
+    T* outputs_gradient     = nullptr;
+    T* activations_gradient = nullptr;
+    T* hidden_delta         = nullptr; // the deltas carried back through hidden_hidden_weights
+
+    // Hidden state carried from one chunk to the next by truncated BPTT, [batch][dimension]
+    T* state = nullptr;
+    size_t state_batch = 0;    // sequences in the carried state, 0 if there is none
+    size_t state_capacity = 0; // sequences state has room for, grown apart from the batch buffers
+
+    T* chunk_input    = nullptr; // the current chunk of each sequence, gathered by BackPropagateTruncated
+    T* chunk_expected = nullptr;
+
+    // Gradient checkpointing, off while checkpoint_interval is 0. Training then keeps only the hidden state entering
+    // every checkpoint_interval-th timestep and recomputes one segment of that many timesteps at a time during the
+    // backward pass, so the segment buffers below hold checkpoint_interval timesteps per sequence instead of
+    // timesteps, for the cost of a second forward pass
+    size_t checkpoint_interval = 0;
+    size_t segment_capacity = 0;
+
+    T* checkpoints = nullptr; // [batch][segments][dimension]
+
+    T* segment_x                    = nullptr;
+    T* segment_activations          = nullptr;
+    T* segment_outputs              = nullptr;
+    T* segment_probabilities        = nullptr;
+    T* segment_outputs_gradient     = nullptr;
+    T* segment_activations_gradient = nullptr;
+    T* segment_delta                = nullptr;
+    T* carried_delta                = nullptr; // [batch][dimension], from the first timestep of the later segment
+
+    // Streaming state for Step, one timestep of one sequence. A zero hidden state is the start of a sequence
+    T* stream_hidden;
+    T* stream_x;
+    T* stream_outputs;
+    T* stream_probabilities;
+
+    AliasTable* sampler;
+
+    // Gradients of the weights and biases, summed over the batch //* Note: these do not vary with time
+    T* input_hidden_gradient;
+    T* hidden_output_gradient;
+    T* hidden_hidden_gradient;
+    T* x_biases_gradient;
+    T* output_biases_gradient;
+
+    RecurrentLayer (size_t dimension, size_t timesteps, float learning_rate = 0.01, bool fast_math = false) 
+        : timesteps {timesteps}, dimension {dimension}, learning_rate {learning_rate}, fast_math {fast_math}
     {
         size_t dimensions [2] = {timesteps, dimension};
 
@@ -699,231 +1028,2576 @@ struct RecurrentLayer
 
         // x_biases -> SetElements (0.0);
         // output_biases -> SetElements (0.0);
+
+        input_hidden_gradient  = new T [dimension * dimension];
+        hidden_output_gradient = new T [dimension * dimension];
+        hidden_hidden_gradient = new T [dimension * dimension];
+        x_biases_gradient      = new T [dimension];
+        output_biases_gradient = new T [dimension];
+
+        stream_hidden        = new T [dimension]{};
+        stream_x             = new T [dimension];
+        stream_outputs       = new T [dimension];
+        stream_probabilities = new T [dimension];
+
+        sampler = new AliasTable (dimension);
+
+        Reserve (1);
     };
 
-    void Propagate (const Tensor <T, 2>& input) 
+    ~RecurrentLayer ()
     {
-        const size_t M = x -> dimensions [1];
+        delete x;
+        delete activations;
+        delete outputs;
+        delete probabilities;
 
-        for (uint i = 0; i < timesteps; i++)
-        {
-            for (uint j = 0; j < M; j++)
-            {
-                (*x) [i][j] = (*x_biases) [j];
+        delete input_hidden_weights;
+        delete hidden_output_weights;
+        delete hidden_hidden_weights;
 
-                for (uint k = 0; k < M; k++)
-                {
-                    if (i > 0)
-                    {
-                        (*x) [i][j] += (*hidden_hidden_weights) [j][k] * (*activations) [i - 1][k];
-                    };
-                    (*x) [i][j] += (*input_hidden_weights) [j][k] * input [i][k];
-                };
+        delete x_biases;
+        delete output_biases;
 
-                (*activations) [i][j] = tanh ((*x) [i][j]);
+        __free_batch ();
 
-                T weighted_sum_output = 0;
+        delete [] input_hidden_gradient;
+        delete [] hidden_output_gradient;
+        delete [] hidden_hidden_gradient;
+        delete [] x_biases_gradient;
+        delete [] output_biases_gradient;
 
-                for (uint k = 0; k < M; k++)
-                {
-                    weighted_sum_output += (*hidden_output_weights) [j][k] * (*activations) [i][k];
-                };
+        delete [] stream_hidden;
+        delete [] stream_x;
+        delete [] stream_outputs;
+        delete [] stream_probabilities;
 
-                (*outputs) [i][j] = (*output_biases) [j] + weighted_sum_output;
-            };
+        delete sampler;
+        delete [] state;
 
-            Softmax <T, 1> ((*outputs) [i], (*probabilities) [i]);
-        };
+        __free_segments ();
     };
 
-    float BackPropagate (const Tensor <T, 2>& input, const Tensor <T, 2>& expected)
+    RecurrentLayer (const RecurrentLayer&) = delete;
+
+    void __free_batch ()
     {
-        Propagate (input);
+        delete [] batch_x;
+        delete [] batch_activations;
+        delete [] batch_outputs;
+        delete [] batch_probabilities;
 
-        const float loss = NegativeLogLikelyhood <T, 2> ((*probabilities), expected);
+        delete [] outputs_gradient;
+        delete [] activations_gradient;
+        delete [] hidden_delta;
 
-        size_t weight_dimensions [2] = {dimension, dimension};
+        delete [] chunk_input;
+        delete [] chunk_expected;
+    };
 
-        // Declare gradients of intermediary variables
-        Tensor <T, 2> outputs_gradient     (outputs -> dimensions);
-        Tensor <T, 2> activations_gradient (activations -> dimensions);
-        Tensor <T, 2> x_gradient           (x -> dimensions);
-        Tensor <T, 2> input_gradient       (input.dimensions);
+    // Makes room for batches of up to batch sequences
+    void Reserve (size_t batch)
+    {
+        if (batch <= capacity) return;
 
-        // Declare gradients of weight matrices //* Note: these do not vary with time
-        Tensor <T, 2> input_hidden_gradient  (weight_dimensions);
-        Tensor <T, 2> hidden_output_gradient (weight_dimensions);
-        Tensor <T, 2> hidden_hidden_gradient (weight_dimensions);
+        __free_batch ();
 
-        // Declare gradients of bias matrices //* Note: these do not vary with time
-        Tensor <T, 1> x_biases_gradient (dimension);
-        Tensor <T, 1> output_biases_gradient (dimension);
+        const size_t length = batch * timesteps * dimension;
 
-        NegativeLogLikelyhoodGradient <T, 2> ((*probabilities), expected, outputs_gradient);
+        batch_x             = new T [length];
+        batch_activations   = new T [length];
+        batch_outputs       = new T [length];
+        batch_probabilities = new T [length];
 
-        // Backpropagation Through Time
-        for (int i = timesteps - 1; i > -1; i--)
-        {
-            for (uint j = 0; j < dimension; j++)
-            {
-                output_biases_gradient [j] += outputs_gradient [i][j];
+        outputs_gradient     = new T [length];
+        activations_gradient = new T [length];
+        hidden_delta         = new T [length];
 
-                for (uint k = 0; k < dimension; k++)
-                {
-                    hidden_output_gradient [j][k] += outputs_gradient [i][j] * (*activations) [i][k];
-                };
-            };
+        chunk_input    = new T [length];
+        chunk_expected = new T [length];
 
-            for (uint j = 0; j < dimension; j++)
-            {
-                for (uint k = 0; k < dimension; k++)
-                {
-                    activations_gradient [i][j] += (*hidden_output_weights) [k][j] * outputs_gradient [i][k]; //? Is transpose because of multiplication order?
-                };
-            };
+        capacity = batch;
 
-            if (i < timesteps - 1)
-            {
-                for (uint j = 0; j < dimension; j++)
-                {
-                    for (uint k = 0; k < dimension; k++)
-                    {
-                        activations_gradient [i][j] += (*hidden_hidden_weights) [k][j] * TanhDerivative ((*activations) [i + 1][k]) * activations_gradient [i + 1][k];
-                    };
-                };
-            };
+        __reserve_state (batch);
+    };
 
-            for (uint j = 0; j < dimension; j++)
-            {
-                x_gradient [i][j] = TanhDerivative (activations_gradient [i][j]);
-                x_biases_gradient [j] += x_gradient [i][j];
-            };
+    // The checkpointed path carries state without the batch buffers, so state is grown on its own
+    void __reserve_state (size_t batch)
+    {
+        if (batch <= state_capacity) return;
 
-            for (uint j = 0; j < dimension; j++)
-            {
-                for (uint k = 0; k < dimension; k++)
-                {
-                    input_hidden_gradient [j][k] += x_gradient [i][j] * input [i][k];
-                };
-            };
+        delete [] state;
 
-            for (uint j = 0; j < dimension; j++)
-            {
-                for (uint k = 0; k < dimension; k++)
-                {
-                    input_gradient [i][j] += (*input_hidden_weights) [k][j] * x_gradient [i][k]; //? Is transpose because of multiplication order?
-                };
-            };
+        state = new T [batch * dimension];
+        state_batch = 0;
+        state_capacity = batch;
+    };
 
-            for (uint j = 0; j < dimension; j++)
-            {
-                for (uint k = 0; k < dimension; k++)
-                {
-                    hidden_hidden_gradient [j][k] += TanhDerivative ((*activations) [i][j]) * activations_gradient [i][j] * input [i][k];
-                };
-            };
-        };
+    // Single sequence [timesteps, dimension], leaving the results in x, activations, outputs and probabilities
+    void Propagate (const Tensor <T, 2>& input) 
+    {
+        __propagate (input.elements, 1);
+        __copy_sequence ();
+    };
 
-        const float regulariser_input_hidden_weights  = Regulariser <T, 2> ((*input_hidden_weights));
-        const float regulariser_hidden_output_weights = Regulariser <T, 2> ((*hidden_output_weights));
-        const float regulariser_hidden_hidden_weights = Regulariser <T, 2> ((*hidden_hidden_weights));
+    float BackPropagate (const Tensor <T, 2>& input, const Tensor <T, 2>& expected)
+    {
+        const float loss = __backpropagate (input.elements, expected.elements, 1);
+        __copy_sequence ();
 
-        const float regulariser_x_biases      = Regulariser <T, 1> ((*x_biases));
-        const float regulariser_output_biases = Regulariser <T, 1> ((*output_biases));
+        return loss;
+    };
 
-        // Update weights
-        for (uint j = 0; j < dimension; j++)
-        {
-            for (uint k = 0; k < dimension; k++)
-            {
-                (*input_hidden_weights)  [j][k] -= learning_rate * input_hidden_gradient  [j][k] / regulariser_input_hidden_weights;
-                (*hidden_output_weights) [j][k] -= learning_rate * hidden_output_gradient [j][k] / regulariser_hidden_output_weights;
-                (*hidden_hidden_weights) [j][k] -= learning_rate * hidden_hidden_gradient [j][k] / regulariser_hidden_hidden_weights;
-            };
+    // Batch of sequences [batch, timesteps, dimension], leaving the results in the batch buffers
+    void Propagate (const Tensor <T, 3>& input) 
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
 
-            (*x_biases)      [j] -= learning_rate * x_biases_gradient      [j] / regulariser_x_biases;
-            (*output_biases) [j] -= learning_rate * output_biases_gradient [j] / regulariser_output_biases;
-        };
+        __propagate (input.elements, input.dimensions [0]);
+    };
 
-        return loss;
+    // Trains on a batch of sequences with one weight update, scaled by the mean over the batch. Returns the mean
+    // loss per sequence
+    float BackPropagate (const Tensor <T, 3>& input, const Tensor <T, 3>& expected)
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
+
+        return __backpropagate (input.elements, expected.elements, input.dimensions [0]);
     };
-};
 
-template <typename T, size_t Dim, bool Chns>
-struct ConvolutionLayer 
-{
-    Tensor <T, Dim + Chns>* output;
-    Tensor <T, Dim + (2 * Chns)>* kernel;
+    // Batch of sequences of any lengths, packed by PackedSequence. Each timestep only processes the sequences still
+    // running, and the results are left packed the same way in the batch buffers
+    void Propagate (const PackedSequence <T>& input)
+    {
+        assert (input.width == dimension);
 
-    ConvolutionType type;
-    uint downsample;
+        __propagate_packed (input);
+    };
 
-    const float base_learning_rate;
-    float learning_rate;
+    // Trains on a packed batch with one weight update, scaled by the mean over the sequences. expected must be
+    // packed from sequences of the same lengths. Returns the mean loss per sequence
+    float BackPropagate (const PackedSequence <T>& input, const PackedSequence <T>& expected)
+    {
+        assert (input.width == dimension && expected.Rows () == input.Rows ());
 
-    const float regularisation_factor;
+        return __backpropagate_packed (input, expected);
+    };
 
-    ConvolutionLayer 
-    (
-        Tensor <T, Dim + (2 * Chns)>* initial_kernel, 
-        size_t input_dim [Dim + Chns], 
-        size_t output_dim [Dim + Chns],
-        size_t kernel_dim [Dim + (2 * Chns)], 
-        NormalisedRandom <1>* r, 
-        ConvolutionType type,
-        uint downsample,
-        float base_learning_rate = 1.0,
-        float regularisation_factor = 0.001
-    )
-        :   type {type}, 
-            downsample {downsample}, 
-            base_learning_rate {base_learning_rate}, 
-            learning_rate {base_learning_rate}, 
-            regularisation_factor {regularisation_factor}
+    // Checkpoints every interval timesteps; 0 turns checkpointing off. Memory per sequence is then about
+    // 7 * interval + timesteps / interval rows rather than 7 * timesteps. Without an interval it is
+    // sqrt (timesteps); memory alone is least at sqrt (timesteps / 7), but recomputation costs more there
+    void UseCheckpointing (size_t interval)
     {
-        output = new Tensor <T, Dim + Chns> (output_dim);
-        kernel = new Tensor <T, Dim + (2 * Chns)> (kernel_dim);
+        __free_segments ();
 
-        if (initial_kernel == nullptr)
-        {
-            Iterate <NormalisedRandom <1>*, Tensor <T, Dim + (2 * Chns)>*, Dim + (2 * Chns)> (InitialiseKernel <T, Dim, Chns>, r, kernel, kernel_dim);
-        }
-        else 
-        {
-            kernel -> SetElements (initial_kernel);
-        };
+        checkpoint_interval = std::min (interval, timesteps);
+        segment_capacity = 0;
     };
 
-    void Propagate (const Tensor <T, Dim + Chns>& input) 
+    void UseCheckpointing ()
     {
-        Convolve <T, Dim, Chns, false> (input, (*kernel), (*output), type, downsample);
+        UseCheckpointing (std::max ((size_t)1, (size_t)std::lround (std::sqrt ((double)timesteps))));
     };
 
-    float BackPropagate (const Tensor <T, Dim + Chns>& input, const Tensor <T, Dim + Chns>& expected) 
+    void __free_segments ()
     {
-        Propagate (input);
+        delete [] checkpoints;
+
+        delete [] segment_x;
+        delete [] segment_activations;
+        delete [] segment_outputs;
+        delete [] segment_probabilities;
+        delete [] segment_outputs_gradient;
+        delete [] segment_activations_gradient;
+        delete [] segment_delta;
+        delete [] carried_delta;
+
+        checkpoints = nullptr;
+
+        segment_x                    = nullptr;
+        segment_activations          = nullptr;
+        segment_outputs              = nullptr;
+        segment_probabilities        = nullptr;
+        segment_outputs_gradient     = nullptr;
+        segment_activations_gradient = nullptr;
+        segment_delta                = nullptr;
+        carried_delta                = nullptr;
+    };
 
-        Tensor <T, Dim + Chns> input_gradient (input.dimensions);
-        Tensor <T, Dim + Chns> output_gradient (output -> dimensions);
-        Tensor <T, Dim + (2 * Chns)> kernel_gradient (kernel -> dimensions);
+    void __reserve_segments (size_t batch)
+    {
+        if (batch <= segment_capacity) return;
 
-        // Tensor <T, Dim + Chns> flipped_input = input.Copy ();
-        // Tensor <T, Dim + (2 * Chns)> flipped_kernel = (*kernel).Copy ();
+        __free_segments ();
 
-        // flipped_input.Rotate ();
-        // flipped_kernel.Flip ();
+        const size_t segments = (timesteps + checkpoint_interval - 1) / checkpoint_interval;
+        const size_t length = batch * checkpoint_interval * dimension;
 
-        MeanSquaredErrorGradient <T, Dim + Chns> (*output, expected, output_gradient);
-        const float loss = MeanSquaredError <T, Dim + Chns> (*output, expected);
-        // float loss = MeanSquaredError <T, Dim + Chns> (*output, expected) + Regulariser <T, Dim + (2 * Chns)> (*kernel);
+        checkpoints = new T [batch * segments * dimension];
 
-        // Convolve <T, Dim, Chns, false> (output_gradient, (*kernel), input_gradient, type, downsample);
-        // expected.Print ("expected");
-        // (*output).Print ("output");
+        segment_x                    = new T [length];
+        segment_activations          = new T [length];
+        segment_outputs              = new T [length];
+        segment_probabilities        = new T [length];
+        segment_outputs_gradient     = new T [length];
+        segment_activations_gradient = new T [length];
+        segment_delta                = new T [length];
+        carried_delta                = new T [batch * dimension];
 
-        // output_gradient.Print ("output gradient");
+        segment_capacity = batch;
+    };
 
-        // TODO: 
+    // Truncated BPTT over long sequences, timesteps steps at a time. Trains on the next chunk
+    // [batch, timesteps, dimension] of batch sequences, starting from the hidden state the previous chunk ended
+    // in. Gradients stop at the start of the chunk, so memory is bounded by the chunk however long the sequences
+    float BackPropagateChunk (const Tensor <T, 3>& input, const Tensor <T, 3>& expected)
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
+
+        return __backpropagate (input.elements, expected.elements, input.dimensions [0], true);
+    };
+
+    // Forgets the carried hidden state, so the next chunk starts from zero as a new sequence
+    void ResetState ()
+    {
+        state_batch = 0;
+    };
+
+    // Trains on whole sequences [batch, length, dimension], length a multiple of timesteps, chunk by chunk with one
+    // weight update per chunk. Starts from zero hidden state. Returns the mean loss per sequence and chunk
+    float BackPropagateTruncated (const Tensor <T, 3>& input, const Tensor <T, 3>& expected)
+    {
+        const size_t batch = input.dimensions [0];
+        const size_t length = input.dimensions [1];
+        const size_t stride = timesteps * dimension;
+
+        assert (length % timesteps == 0 && input.dimensions [2] == dimension);
+
+        Reserve (batch);
+        ResetState ();
+
+        float loss = 0.0;
+
+        for (size_t c = 0; c < length / timesteps; c++)
+        {
+            for (size_t b = 0; b < batch; b++)
+            {
+                const size_t offset = b * length * dimension + c * stride;
+
+                std::copy (input.elements    + offset, input.elements    + offset + stride, chunk_input    + b * stride);
+                std::copy (expected.elements + offset, expected.elements + offset + stride, chunk_expected + b * stride);
+            };
+
+            loss += __backpropagate (chunk_input, chunk_expected, batch, true);
+        };
+
+        return loss / (length / timesteps);
+    };
+
+    // Advances the streaming state by one timestep and returns the output distribution, in O(dimension^2)
+    // rather than recomputing the whole sequence
+    const T* Step (const T input [])
+    {
+        const size_t D = dimension;
+
+        std::copy (x_biases -> elements, x_biases -> elements + D, stream_x);
+        std::copy (output_biases -> elements, output_biases -> elements + D, stream_outputs);
+
+        Gemm <false, true> (1, D, D, input, D, input_hidden_weights -> elements, D, stream_x, D, true);
+        Gemm <false, true> (1, D, D, stream_hidden, D, hidden_hidden_weights -> elements, D, stream_x, D, true);
+
+        Activate (hyperbolic_tangent, stream_x, stream_hidden, D, fast_math);
+
+        Gemm <false, true> (1, D, D, stream_hidden, D, hidden_output_weights -> elements, D, stream_outputs, D, true);
+
+        if (fast_math)
+        {
+            SoftmaxKernel <T, FastMath> (stream_outputs, stream_probabilities, D);
+        }
+        else
+        {
+            SoftmaxKernel <T> (stream_outputs, stream_probabilities, D);
+        };
+
+        return stream_probabilities;
+    };
+
+    // Starts a new stream
+    void ResetStream ()
+    {
+        std::fill (stream_hidden, stream_hidden + dimension, (T)0);
+    };
+
+    // The streaming state is the hidden state alone, dimension values
+    void SaveStream (T snapshot []) const
+    {
+        std::copy (stream_hidden, stream_hidden + dimension, snapshot);
+    };
+
+    void RestoreStream (const T snapshot [])
+    {
+        std::copy (snapshot, snapshot + dimension, stream_hidden);
+    };
+
+    // Generates steps tokens from the stream, feeding each sampled class back as a one-hot input. first is the
+    // input for the first step
+    template <typename Generator>
+    void Generate (const T first [], size_t steps, size_t tokens [], Generator& generator)
+    {
+        T* input = new T [dimension];
+        std::copy (first, first + dimension, input);
+
+        for (size_t s = 0; s < steps; s++)
+        {
+            sampler -> Build (Step (input));
+            tokens [s] = sampler -> Sample (generator);
+
+            std::fill (input, input + dimension, (T)0);
+            input [tokens [s]] = 1;
+        };
+
+        delete [] input;
+    };
+
+    void __copy_sequence ()
+    {
+        const size_t length = timesteps * dimension;
+
+        std::copy (batch_x,             batch_x             + length, x             -> elements);
+        std::copy (batch_activations,   batch_activations   + length, activations   -> elements);
+        std::copy (batch_outputs,       batch_outputs       + length, outputs       -> elements);
+        std::copy (batch_probabilities, batch_probabilities + length, probabilities -> elements);
+    };
+
+    // The input and output projections do not depend on the hidden state, so each is one GEMM over all
+    // batch * timesteps rows. Only the hidden_hidden recurrence runs timestep by timestep, as a GEMM over the batch
+    // in which row b is sequence b at time i. With carry, the first timestep continues from the carried hidden
+    // state; __keep_state then keeps the last one's for the next call
+    void __propagate (const T* input, size_t batch, bool carry = false)
+    {
+        assert (!carry || state_batch == 0 || state_batch == batch);
+
+        Reserve (batch);
+
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+        const size_t rows = batch * timesteps;
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            std::copy (x_biases -> elements, x_biases -> elements + D, batch_x + r * D);
+            std::copy (output_biases -> elements, output_biases -> elements + D, batch_outputs + r * D);
+        };
+
+        Gemm <false, true> (rows, D, D, input, D, input_hidden_weights -> elements, D, batch_x, D, true);
+
+        for (size_t i = 0; i < timesteps; i++)
+        {
+            const size_t offset = i * D;
+
+            if (i > 0)
+            {
+                Gemm <false, true> (batch, D, D, batch_activations + offset - D, stride, hidden_hidden_weights -> elements, D, batch_x + offset, stride, true);
+            }
+            else if (carry && state_batch == batch)
+            {
+                Gemm <false, true> (batch, D, D, state, D, hidden_hidden_weights -> elements, D, batch_x, stride, true);
+            };
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                Activate (hyperbolic_tangent, batch_x + b * stride + offset, batch_activations + b * stride + offset, D, fast_math);
+            };
+        };
+
+        Gemm <false, true> (rows, D, D, batch_activations, D, hidden_output_weights -> elements, D, batch_outputs, D, true);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            if (fast_math)
+            {
+                SoftmaxKernel <T, FastMath> (batch_outputs + r * D, batch_probabilities + r * D, D);
+            }
+            else
+            {
+                SoftmaxKernel <T> (batch_outputs + r * D, batch_probabilities + r * D, D);
+            };
+        };
+    };
+
+    // Carries the hidden state of the last timestep of each sequence in the batch buffers into the next call
+    void __keep_state (size_t batch)
+    {
+        const size_t stride = timesteps * dimension;
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            const T* last = batch_activations + b * stride + stride - dimension;
+            std::copy (last, last + dimension, state + b * dimension);
+        };
+
+        state_batch = batch;
+    };
+
+    float __backpropagate (const T* input, const T* expected, size_t batch, bool carry = false)
+    {
+        if (checkpoint_interval > 0) return __backpropagate_checkpointed (input, expected, batch, carry);
+
+        __propagate (input, batch, carry);
+
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+        const size_t length = batch * stride;
+
+        float loss = 0.0;
+        const float epsilon = 0.01;
+
+        // Softmax and negative log likelihood together, so the gradient of the outputs is p - expected
+        for (size_t i = 0; i < length; i++)
+        {
+            loss += expected [i] * (fast_math ? FastLog (batch_probabilities [i] + epsilon) : std::log (batch_probabilities [i] + epsilon));
+            outputs_gradient [i] = batch_probabilities [i] - expected [i];
+        };
+
+        const size_t rows = batch * timesteps;
+
+        // The output terms of the activation gradients do not depend on later timesteps
+        Gemm <false, false> (rows, D, D, outputs_gradient, D, hidden_output_weights -> elements, D, activations_gradient, D);
+
+        // Backpropagation Through Time, every sequence of the batch at once. Only the deltas carried back through
+        // hidden_hidden_weights are serial; they are kept for every timestep so the weight gradients can follow.
+        // The delta takes the tanh derivative from the activation, 1 - a^2, and is the gradient of x, so the input
+        // weights and biases take it as well
+        for (size_t i = timesteps; i-- > 0;)
+        {
+            const size_t offset = i * D;
+
+            const T* a = batch_activations + offset;
+            T* ag = activations_gradient + offset;
+            T* delta = hidden_delta + offset;
+
+            if (i + 1 < timesteps)
+            {
+                Gemm <false, false> (batch, D, D, delta + D, stride, hidden_hidden_weights -> elements, D, ag, stride, true);
+            };
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                for (size_t j = 0; j < D; j++)
+                {
+                    delta [b * stride + j] = (1 - a [b * stride + j] * a [b * stride + j]) * ag [b * stride + j];
+                };
+            };
+        };
+
+        // Each weight gradient is then one GEMM over all batch * timesteps rows
+        Gemm <true, false> (D, D, rows, outputs_gradient, D, batch_activations, D, hidden_output_gradient, D);
+        Gemm <true, false> (D, D, rows, hidden_delta,     D, input,             D, input_hidden_gradient,  D);
+
+        // The hidden_hidden gradient pairs the delta of timestep t with the activations of timestep t - 1, so it
+        // runs per sequence over the timesteps after the first. The first pairs with the carried state, if any
+        std::fill (hidden_hidden_gradient, hidden_hidden_gradient + D * D, (T)0);
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            Gemm <true, false> (D, D, timesteps - 1, hidden_delta + b * stride + D, D, batch_activations + b * stride, D, hidden_hidden_gradient, D, true);
+        };
+
+        if (carry && state_batch == batch)
+        {
+            Gemm <true, false> (D, D, batch, hidden_delta, stride, state, D, hidden_hidden_gradient, D, true);
+        };
+
+        if (carry) __keep_state (batch);
+
+        std::fill (x_biases_gradient,      x_biases_gradient      + D, (T)0);
+        std::fill (output_biases_gradient, output_biases_gradient + D, (T)0);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < D; j++)
+            {
+                x_biases_gradient      [j] += hidden_delta     [r * D + j];
+                output_biases_gradient [j] += outputs_gradient [r * D + j];
+            };
+        };
+
+        __update (batch);
+
+        return - loss / batch;
+    };
+
+    // Runs steps timesteps of batch sequences from the hidden states initial, one row per sequence initial_stride
+    // apart. input rows are read with the layer's full sequence stride, the results written to buffers holding
+    // stride values per sequence
+    void __forward_segment (const T* input, const T* initial, size_t initial_stride, size_t batch, size_t steps, T* x, T* a, T* out, T* p, size_t stride)
+    {
+        const size_t D = dimension;
+        const size_t input_stride = timesteps * D;
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            for (size_t i = 0; i < steps; i++)
+            {
+                std::copy (x_biases -> elements, x_biases -> elements + D, x + b * stride + i * D);
+                std::copy (output_biases -> elements, output_biases -> elements + D, out + b * stride + i * D);
+            };
+
+            Gemm <false, true> (steps, D, D, input + b * input_stride, D, input_hidden_weights -> elements, D, x + b * stride, D, true);
+        };
+
+        for (size_t i = 0; i < steps; i++)
+        {
+            const T* previous = (i > 0) ? a + (i - 1) * D : initial;
+
+            Gemm <false, true> (batch, D, D, previous, (i > 0) ? stride : initial_stride, hidden_hidden_weights -> elements, D, x + i * D, stride, true);
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                Activate (hyperbolic_tangent, x + b * stride + i * D, a + b * stride + i * D, D, fast_math);
+            };
+        };
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            Gemm <false, true> (steps, D, D, a + b * stride, D, hidden_output_weights -> elements, D, out + b * stride, D, true);
+
+            for (size_t i = 0; i < steps; i++)
+            {
+                if (fast_math)
+                {
+                    SoftmaxKernel <T, FastMath> (out + b * stride + i * D, p + b * stride + i * D, D);
+                }
+                else
+                {
+                    SoftmaxKernel <T> (out + b * stride + i * D, p + b * stride + i * D, D);
+                };
+            };
+        };
+    };
+
+    // The same training step as __backpropagate, segment by segment. A forward sweep keeps only the hidden state
+    // entering each segment; the backward pass then recomputes each segment from its checkpoint, last to first,
+    // and carries the delta across segment boundaries
+    float __backpropagate_checkpointed (const T* input, const T* expected, size_t batch, bool carry)
+    {
+        assert (!carry || state_batch == 0 || state_batch == batch);
+
+        __reserve_segments (batch);
+        __reserve_state (batch);
+
+        const size_t D = dimension;
+        const size_t k = checkpoint_interval;
+        const size_t segments = (timesteps + k - 1) / k;
+        const size_t stride = timesteps * D;
+        const size_t segment_stride = k * D;
+        const size_t checkpoint_stride = segments * D;
+
+        const float epsilon = 0.01;
+        float loss = 0.0;
+
+        for (size_t s = 0; s < segments; s++)
+        {
+            const size_t first = s * k;
+            const size_t steps = std::min (k, timesteps - first);
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                T* checkpoint = checkpoints + b * checkpoint_stride + s * D;
+
+                if (s > 0)
+                {
+                    const T* last = segment_activations + b * segment_stride + (k - 1) * D;
+                    std::copy (last, last + D, checkpoint);
+                }
+                else if (carry && state_batch == batch)
+                {
+                    std::copy (state + b * D, state + b * D + D, checkpoint);
+                }
+                else
+                {
+                    std::fill (checkpoint, checkpoint + D, (T)0);
+                };
+            };
+
+            __forward_segment (input + first * D, checkpoints + s * D, checkpoint_stride, batch, steps, segment_x, segment_activations, segment_outputs, segment_probabilities, segment_stride);
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                for (size_t r = 0; r < steps * D; r++)
+                {
+                    const T p = segment_probabilities [b * segment_stride + r];
+                    loss += expected [b * stride + first * D + r] * (fast_math ? FastLog (p + epsilon) : std::log (p + epsilon));
+                };
+            };
+
+            if (carry && s + 1 == segments)
+            {
+                for (size_t b = 0; b < batch; b++)
+                {
+                    const T* last = segment_activations + b * segment_stride + (steps - 1) * D;
+                    std::copy (last, last + D, state + b * D);
+                };
+
+                state_batch = batch;
+            };
+        };
+
+        std::fill (input_hidden_gradient,  input_hidden_gradient  + D * D, (T)0);
+        std::fill (hidden_output_gradient, hidden_output_gradient + D * D, (T)0);
+        std::fill (hidden_hidden_gradient, hidden_hidden_gradient + D * D, (T)0);
+        std::fill (x_biases_gradient,      x_biases_gradient      + D,     (T)0);
+        std::fill (output_biases_gradient, output_biases_gradient + D,     (T)0);
+
+        for (size_t s = segments; s-- > 0;)
+        {
+            const size_t first = s * k;
+            const size_t steps = std::min (k, timesteps - first);
+
+            __forward_segment (input + first * D, checkpoints + s * D, checkpoint_stride, batch, steps, segment_x, segment_activations, segment_outputs, segment_probabilities, segment_stride);
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                for (size_t r = 0; r < steps * D; r++)
+                {
+                    const size_t i = b * segment_stride + r;
+                    segment_outputs_gradient [i] = segment_probabilities [i] - expected [b * stride + first * D + r];
+                };
+
+                Gemm <false, false> (steps, D, D, segment_outputs_gradient + b * segment_stride, D, hidden_output_weights -> elements, D, segment_activations_gradient + b * segment_stride, D);
+            };
+
+            for (size_t i = steps; i-- > 0;)
+            {
+                const size_t offset = i * D;
+
+                const T* a = segment_activations + offset;
+                T* ag = segment_activations_gradient + offset;
+                T* delta = segment_delta + offset;
+
+                if (i + 1 < steps)
+                {
+                    Gemm <false, false> (batch, D, D, delta + D, segment_stride, hidden_hidden_weights -> elements, D, ag, segment_stride, true);
+                }
+                else if (first + i + 1 < timesteps)
+                {
+                    Gemm <false, false> (batch, D, D, carried_delta, D, hidden_hidden_weights -> elements, D, ag, segment_stride, true);
+                };
+
+                for (size_t b = 0; b < batch; b++)
+                {
+                    for (size_t j = 0; j < D; j++)
+                    {
+                        delta [b * segment_stride + j] = (1 - a [b * segment_stride + j] * a [b * segment_stride + j]) * ag [b * segment_stride + j];
+                    };
+                };
+            };
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                const T* in = input + b * stride + first * D;
+                const size_t row = b * segment_stride;
+
+                std::copy (segment_delta + row, segment_delta + row + D, carried_delta + b * D);
+
+                Gemm <true, false> (D, D, steps,     segment_outputs_gradient + row, D, segment_activations + row, D, hidden_output_gradient, D, true);
+                Gemm <true, false> (D, D, steps,     segment_delta + row,            D, in,                        D, input_hidden_gradient,  D, true);
+                Gemm <true, false> (D, D, steps - 1, segment_delta + row + D,        D, segment_activations + row, D, hidden_hidden_gradient, D, true);
+
+                for (size_t r = 0; r < steps * D; r += D)
+                {
+                    for (size_t j = 0; j < D; j++)
+                    {
+                        x_biases_gradient      [j] += segment_delta            [row + r + j];
+                        output_biases_gradient [j] += segment_outputs_gradient [row + r + j];
+                    };
+                };
+            };
+
+            // The first timestep of the segment pairs with its checkpoint, zero at the start of a sequence
+            Gemm <true, false> (D, D, batch, segment_delta, segment_stride, checkpoints + s * D, checkpoint_stride, hidden_hidden_gradient, D, true);
+        };
+
+        __update (batch);
+
+        return - loss / batch;
+    };
+
+    // The batch buffers hold packed rows here, so they are reserved by rows rather than by sequences
+    void __propagate_packed (const PackedSequence <T>& packed)
+    {
+        const size_t D = dimension;
+        const size_t rows = packed.Rows ();
+        const T* input = packed.elements;
+
+        Reserve ((rows + timesteps - 1) / timesteps);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            std::copy (x_biases -> elements, x_biases -> elements + D, batch_x + r * D);
+            std::copy (output_biases -> elements, output_biases -> elements + D, batch_outputs + r * D);
+        };
+
+        Gemm <false, true> (rows, D, D, input, D, input_hidden_weights -> elements, D, batch_x, D, true);
+
+        for (size_t t = 0; t < packed.max_length; t++)
+        {
+            const size_t offset = packed.step_offsets [t] * D;
+            const size_t active = packed.batch_sizes [t];
+
+            if (t > 0)
+            {
+                Gemm <false, true> (active, D, D, batch_activations + packed.step_offsets [t - 1] * D, D, hidden_hidden_weights -> elements, D, batch_x + offset, D, true);
+            };
+
+            Activate (hyperbolic_tangent, batch_x + offset, batch_activations + offset, active * D, fast_math);
+        };
+
+        Gemm <false, true> (rows, D, D, batch_activations, D, hidden_output_weights -> elements, D, batch_outputs, D, true);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            if (fast_math)
+            {
+                SoftmaxKernel <T, FastMath> (batch_outputs + r * D, batch_probabilities + r * D, D);
+            }
+            else
+            {
+                SoftmaxKernel <T> (batch_outputs + r * D, batch_probabilities + r * D, D);
+            };
+        };
+    };
+
+    // __backpropagate over packed rows. The delta of timestep t + 1 only reaches the sequences still running
+    // then, which are the first batch_sizes [t + 1] rows of timestep t
+    float __backpropagate_packed (const PackedSequence <T>& packed, const PackedSequence <T>& expected_packed)
+    {
+        __propagate_packed (packed);
+
+        const size_t D = dimension;
+        const size_t rows = packed.Rows ();
+        const size_t length = rows * D;
+        const T* input = packed.elements;
+        const T* expected = expected_packed.elements;
+
+        float loss = 0.0;
+        const float epsilon = 0.01;
+
+        for (size_t i = 0; i < length; i++)
+        {
+            loss += expected [i] * (fast_math ? FastLog (batch_probabilities [i] + epsilon) : std::log (batch_probabilities [i] + epsilon));
+            outputs_gradient [i] = batch_probabilities [i] - expected [i];
+        };
+
+        Gemm <false, false> (rows, D, D, outputs_gradient, D, hidden_output_weights -> elements, D, activations_gradient, D);
+
+        for (size_t t = packed.max_length; t-- > 0;)
+        {
+            const size_t offset = packed.step_offsets [t] * D;
+            const size_t active = packed.batch_sizes [t];
+
+            if (t + 1 < packed.max_length)
+            {
+                Gemm <false, false> (packed.batch_sizes [t + 1], D, D, hidden_delta + packed.step_offsets [t + 1] * D, D, hidden_hidden_weights -> elements, D, activations_gradient + offset, D, true);
+            };
+
+            for (size_t j = offset; j < offset + active * D; j++)
+            {
+                hidden_delta [j] = (1 - batch_activations [j] * batch_activations [j]) * activations_gradient [j];
+            };
+        };
+
+        Gemm <true, false> (D, D, rows, outputs_gradient, D, batch_activations, D, hidden_output_gradient, D);
+        Gemm <true, false> (D, D, rows, hidden_delta,     D, input,             D, input_hidden_gradient,  D);
+
+        // Rows of timestep t pair with the first batch_sizes [t] rows of timestep t - 1, the same sequences
+        std::fill (hidden_hidden_gradient, hidden_hidden_gradient + D * D, (T)0);
+
+        for (size_t t = 1; t < packed.max_length; t++)
+        {
+            Gemm <true, false> (D, D, packed.batch_sizes [t], hidden_delta + packed.step_offsets [t] * D, D, batch_activations + packed.step_offsets [t - 1] * D, D, hidden_hidden_gradient, D, true);
+        };
+
+        std::fill (x_biases_gradient,      x_biases_gradient      + D, (T)0);
+        std::fill (output_biases_gradient, output_biases_gradient + D, (T)0);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < D; j++)
+            {
+                x_biases_gradient      [j] += hidden_delta     [r * D + j];
+                output_biases_gradient [j] += outputs_gradient [r * D + j];
+            };
+        };
+
+        __update (packed.count);
+
+        return - loss / packed.count;
+    };
+
+    // Gradient step from the gradients of a batch, a plain step on the batch mean like the other recurrent layers
+    void __update (size_t batch)
+    {
+        const size_t D = dimension;
+
+        // Update weights once for the whole batch
+        const float step = learning_rate / batch;
+
+        for (size_t j = 0; j < D * D; j++)
+        {
+            input_hidden_weights  -> elements [j] -= step * input_hidden_gradient  [j];
+            hidden_output_weights -> elements [j] -= step * hidden_output_gradient [j];
+            hidden_hidden_weights -> elements [j] -= step * hidden_hidden_gradient [j];
+        };
+
+        for (size_t j = 0; j < D; j++)
+        {
+            x_biases      -> elements [j] -= step * x_biases_gradient      [j];
+            output_biases -> elements [j] -= step * output_biases_gradient [j];
+        };
+    };
+};
+
+// Forward LSTM cell for one row of the batch. z holds the pre-activations of the four gates stacked
+// [input | forget | cell | output], each n wide, and is overwritten with the gate values. previous is the cell
+// state of the previous timestep, or nullptr at the first
+template <typename T, typename Math = StandardMath>
+void LSTMCellKernel (T* __restrict z, const T* __restrict previous, T* __restrict cell, T* __restrict cell_tanh, T* __restrict hidden, size_t n)
+{
+    T* input_gate  = z;
+    T* forget_gate = z + n;
+    T* candidate   = z + 2 * n;
+    T* output_gate = z + 3 * n;
+
+    #pragma omp simd
+    for (size_t j = 0; j < n; j++)
+    {
+        input_gate  [j] = 1 / (1 + Math::Exp (- input_gate  [j]));
+        forget_gate [j] = 1 / (1 + Math::Exp (- forget_gate [j]));
+        candidate   [j] = Math::Tanh (candidate [j]);
+        output_gate [j] = 1 / (1 + Math::Exp (- output_gate [j]));
+
+        cell [j] = input_gate [j] * candidate [j] + (previous ? forget_gate [j] * previous [j] : 0);
+        cell_tanh [j] = Math::Tanh (cell [j]);
+        hidden [j] = output_gate [j] * cell_tanh [j];
+    };
+};
+
+// Backward LSTM cell for one row of the batch. Takes the gate values from the forward pass and the gradients
+// of the hidden and cell states, writes the gradients of the four gate pre-activations to dz and replaces
+// cell_gradient with the gradient carried to the previous cell state
+template <typename T>
+void LSTMCellGradientKernel (const T* __restrict z, const T* __restrict previous, const T* __restrict cell_tanh, const T* __restrict hidden_gradient, T* __restrict cell_gradient, T* __restrict dz, size_t n)
+{
+    const T* input_gate  = z;
+    const T* forget_gate = z + n;
+    const T* candidate   = z + 2 * n;
+    const T* output_gate = z + 3 * n;
+
+    #pragma omp simd
+    for (size_t j = 0; j < n; j++)
+    {
+        const T dc = hidden_gradient [j] * output_gate [j] * (1 - cell_tanh [j] * cell_tanh [j]) + cell_gradient [j];
+        const T c = previous ? previous [j] : 0;
+
+        dz [j]         = dc * candidate [j] * input_gate [j] * (1 - input_gate [j]);
+        dz [j + n]     = dc * c * forget_gate [j] * (1 - forget_gate [j]);
+        dz [j + 2 * n] = dc * input_gate [j] * (1 - candidate [j] * candidate [j]);
+        dz [j + 3 * n] = hidden_gradient [j] * cell_tanh [j] * output_gate [j] * (1 - output_gate [j]);
+
+        cell_gradient [j] = dc * forget_gate [j];
+    };
+};
+
+// Long short-term memory layer with the same interface as RecurrentLayer: sequences of dimension wide vectors in,
+// a softmax over dimension classes out at every timestep, trained on the negative log likelihood. The weights of
+// the four gates are stacked into one [4 * dimension, dimension] matrix for the input and one for the hidden state,
+// so every timestep is a single GEMM for all gates followed by one fused pass over the gate nonlinearities
+template <typename T>
+struct LSTMLayer
+{
+    Tensor <T, 2>* activations;   // hidden states of the last single sequence
+    Tensor <T, 2>* probabilities;
+
+    Tensor <T, 2>* input_weights;  // [4 * dimension, dimension], gates stacked [input | forget | cell | output]
+    Tensor <T, 2>* hidden_weights; // [4 * dimension, dimension]
+    Tensor <T, 2>* hidden_output_weights;
+
+    Tensor <T, 1>* gate_biases; // [4 * dimension]
+    Tensor <T, 1>* output_biases;
+
+    size_t timesteps;
+    size_t dimension;
+
+    float learning_rate;
+
+    bool fast_math; // use the vmath.h approximations for the gates, softmax and the loss
+
+    // Batch buffers laid out [batch][timesteps][width], grown by Reserve and never shrunk
+    size_t capacity = 0;
+
+    T* gates         = nullptr; // 4 * dimension wide, pre-activations and then gate values
+    T* cells         = nullptr;
+    T* cells_tanh    = nullptr;
+    T* hidden        = nullptr;
+    T* outputs       = nullptr;
+    T* batch_probabilities = nullptr;
+
+    T* outputs_gradient = nullptr;
+    T* hidden_gradient  = nullptr;
+    T* gates_gradient   = nullptr; // 4 * dimension wide
+    T* cell_gradient    = nullptr; // [batch][dimension], carried from timestep i + 1 to i
+
+    T* input_weights_gradient;
+    T* hidden_weights_gradient;
+    T* hidden_output_gradient;
+    T* gate_biases_gradient;
+    T* output_biases_gradient;
+
+    LSTMLayer (size_t dimension, size_t timesteps, float learning_rate = 0.01, bool fast_math = false)
+        : timesteps {timesteps}, dimension {dimension}, learning_rate {learning_rate}, fast_math {fast_math}
+    {
+        size_t dimensions [2] = {timesteps, dimension};
+
+        activations   = new Tensor <T, 2> (dimensions);
+        probabilities = new Tensor <T, 2> (dimensions);
+
+        size_t gate_dimensions [2] = {4 * dimension, dimension};
+        size_t weight_dimensions [2] = {dimension, dimension};
+
+        input_weights         = new Tensor <T, 2> (gate_dimensions);
+        hidden_weights        = new Tensor <T, 2> (gate_dimensions);
+        hidden_output_weights = new Tensor <T, 2> (weight_dimensions);
+
+        gate_biases   = new Tensor <T, 1> (4 * dimension);
+        output_biases = new Tensor <T, 1> (dimension);
+
+        input_weights         -> template Randomise <std::normal_distribution <T>> ();
+        hidden_weights        -> template Randomise <std::normal_distribution <T>> ();
+        hidden_output_weights -> template Randomise <std::normal_distribution <T>> ();
+
+        // A forget gate that starts open lets gradients reach early timesteps from the first update
+        std::fill (gate_biases -> elements + dimension, gate_biases -> elements + 2 * dimension, (T)1);
+
+        input_weights_gradient  = new T [4 * dimension * dimension];
+        hidden_weights_gradient = new T [4 * dimension * dimension];
+        hidden_output_gradient  = new T [dimension * dimension];
+        gate_biases_gradient    = new T [4 * dimension];
+        output_biases_gradient  = new T [dimension];
+
+        Reserve (1);
+    };
+
+    ~LSTMLayer ()
+    {
+        delete activations;
+        delete probabilities;
+
+        delete input_weights;
+        delete hidden_weights;
+        delete hidden_output_weights;
+
+        delete gate_biases;
+        delete output_biases;
+
+        __free_batch ();
+
+        delete [] input_weights_gradient;
+        delete [] hidden_weights_gradient;
+        delete [] hidden_output_gradient;
+        delete [] gate_biases_gradient;
+        delete [] output_biases_gradient;
+    };
+
+    LSTMLayer (const LSTMLayer&) = delete;
+
+    void __free_batch ()
+    {
+        delete [] gates;
+        delete [] cells;
+        delete [] cells_tanh;
+        delete [] hidden;
+        delete [] outputs;
+        delete [] batch_probabilities;
+
+        delete [] outputs_gradient;
+        delete [] hidden_gradient;
+        delete [] gates_gradient;
+        delete [] cell_gradient;
+    };
+
+    // Makes room for batches of up to batch sequences
+    void Reserve (size_t batch)
+    {
+        if (batch <= capacity) return;
+
+        __free_batch ();
+
+        const size_t length = batch * timesteps * dimension;
+
+        gates               = new T [4 * length];
+        cells               = new T [length];
+        cells_tanh          = new T [length];
+        hidden              = new T [length];
+        outputs             = new T [length];
+        batch_probabilities = new T [length];
+
+        outputs_gradient = new T [length];
+        hidden_gradient  = new T [length];
+        gates_gradient   = new T [4 * length];
+        cell_gradient    = new T [batch * dimension];
+
+        capacity = batch;
+    };
+
+    // Single sequence [timesteps, dimension], leaving the results in activations and probabilities
+    void Propagate (const Tensor <T, 2>& input)
+    {
+        __propagate (input.elements, 1);
+        __copy_sequence ();
+    };
+
+    float BackPropagate (const Tensor <T, 2>& input, const Tensor <T, 2>& expected)
+    {
+        const float loss = __backpropagate (input.elements, expected.elements, 1);
+        __copy_sequence ();
+
+        return loss;
+    };
+
+    // Batch of sequences [batch, timesteps, dimension], leaving the results in the batch buffers
+    void Propagate (const Tensor <T, 3>& input)
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
+
+        __propagate (input.elements, input.dimensions [0]);
+    };
+
+    // Trains on a batch of sequences with one weight update, scaled by the mean over the batch. Returns the mean
+    // loss per sequence
+    float BackPropagate (const Tensor <T, 3>& input, const Tensor <T, 3>& expected)
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
+
+        return __backpropagate (input.elements, expected.elements, input.dimensions [0]);
+    };
+
+    void __copy_sequence ()
+    {
+        const size_t length = timesteps * dimension;
+
+        std::copy (hidden,              hidden              + length, activations   -> elements);
+        std::copy (batch_probabilities, batch_probabilities + length, probabilities -> elements);
+    };
+
+    template <typename Math>
+    void __cells (size_t batch, size_t i)
+    {
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            const size_t row = b * stride + i * D;
+
+            LSTMCellKernel <T, Math> (gates + 4 * row, (i > 0) ? cells + row - D : nullptr, cells + row, cells_tanh + row, hidden + row, D);
+        };
+    };
+
+    // The input projection of all gates and the output projection are each one GEMM over all batch * timesteps
+    // rows; only the hidden_weights recurrence runs timestep by timestep
+    void __propagate (const T* input, size_t batch)
+    {
+        Reserve (batch);
+
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+        const size_t rows = batch * timesteps;
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            std::copy (gate_biases -> elements, gate_biases -> elements + 4 * D, gates + 4 * r * D);
+            std::copy (output_biases -> elements, output_biases -> elements + D, outputs + r * D);
+        };
+
+        Gemm <false, true> (rows, 4 * D, D, input, D, input_weights -> elements, D, gates, 4 * D, true);
+
+        for (size_t i = 0; i < timesteps; i++)
+        {
+            if (i > 0)
+            {
+                Gemm <false, true> (batch, 4 * D, D, hidden + (i - 1) * D, stride, hidden_weights -> elements, D, gates + 4 * i * D, 4 * stride, true);
+            };
+
+            if (fast_math) __cells <FastMath>     (batch, i);
+            else           __cells <StandardMath> (batch, i);
+        };
+
+        Gemm <false, true> (rows, D, D, hidden, D, hidden_output_weights -> elements, D, outputs, D, true);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            if (fast_math)
+            {
+                SoftmaxKernel <T, FastMath> (outputs + r * D, batch_probabilities + r * D, D);
+            }
+            else
+            {
+                SoftmaxKernel <T> (outputs + r * D, batch_probabilities + r * D, D);
+            };
+        };
+    };
+
+    float __backpropagate (const T* input, const T* expected, size_t batch)
+    {
+        __propagate (input, batch);
+
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+        const size_t rows = batch * timesteps;
+        const size_t length = rows * D;
+
+        float loss = 0.0;
+        const float epsilon = 0.01;
+
+        // Softmax and negative log likelihood together, so the gradient of the outputs is p - expected
+        for (size_t i = 0; i < length; i++)
+        {
+            loss += expected [i] * (fast_math ? FastLog (batch_probabilities [i] + epsilon) : std::log (batch_probabilities [i] + epsilon));
+            outputs_gradient [i] = batch_probabilities [i] - expected [i];
+        };
+
+        Gemm <false, false> (rows, D, D, outputs_gradient, D, hidden_output_weights -> elements, D, hidden_gradient, D);
+
+        std::fill (cell_gradient, cell_gradient + batch * D, (T)0);
+
+        // Backpropagation Through Time, every sequence of the batch at once
+        for (size_t i = timesteps; i-- > 0;)
+        {
+            if (i + 1 < timesteps)
+            {
+                Gemm <false, false> (batch, D, 4 * D, gates_gradient + 4 * (i + 1) * D, 4 * stride, hidden_weights -> elements, D, hidden_gradient + i * D, stride, true);
+            };
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                const size_t row = b * stride + i * D;
+
+                LSTMCellGradientKernel <T> (gates + 4 * row, (i > 0) ? cells + row - D : nullptr, cells_tanh + row, hidden_gradient + row, cell_gradient + b * D, gates_gradient + 4 * row, D);
+            };
+        };
+
+        // Weight gradients as GEMMs over all rows. The hidden_weights gradient pairs timestep i with the hidden
+        // state of timestep i - 1, so it runs per sequence over the timesteps after the first
+        Gemm <true, false> (D, D, rows, outputs_gradient, D, hidden, D, hidden_output_gradient, D);
+        Gemm <true, false> (4 * D, D, rows, gates_gradient, 4 * D, input, D, input_weights_gradient, D);
+
+        std::fill (hidden_weights_gradient, hidden_weights_gradient + 4 * D * D, (T)0);
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            Gemm <true, false> (4 * D, D, timesteps - 1, gates_gradient + 4 * (b * stride + D), 4 * D, hidden + b * stride, D, hidden_weights_gradient, D, true);
+        };
+
+        std::fill (gate_biases_gradient,   gate_biases_gradient   + 4 * D, (T)0);
+        std::fill (output_biases_gradient, output_biases_gradient + D,     (T)0);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < 4 * D; j++)
+            {
+                gate_biases_gradient [j] += gates_gradient [4 * r * D + j];
+            };
+
+            for (size_t j = 0; j < D; j++)
+            {
+                output_biases_gradient [j] += outputs_gradient [r * D + j];
+            };
+        };
+
+        // Update weights once for the whole batch
+        const float step = learning_rate / batch;
+
+        for (size_t j = 0; j < 4 * D * D; j++)
+        {
+            input_weights  -> elements [j] -= step * input_weights_gradient  [j];
+            hidden_weights -> elements [j] -= step * hidden_weights_gradient [j];
+        };
+
+        for (size_t j = 0; j < D * D; j++)
+        {
+            hidden_output_weights -> elements [j] -= step * hidden_output_gradient [j];
+        };
+
+        for (size_t j = 0; j < 4 * D; j++)
+        {
+            gate_biases -> elements [j] -= step * gate_biases_gradient [j];
+        };
+
+        for (size_t j = 0; j < D; j++)
+        {
+            output_biases -> elements [j] -= step * output_biases_gradient [j];
+        };
+
+        return - loss / batch;
+    };
+};
+
+// Forward GRU cell for one row of the batch. x holds the input projections of the three gates stacked
+// [reset | update | candidate], each n wide, and is overwritten with the gate values. h holds the hidden
+// projections, with the hidden biases already added. previous is the hidden state of the previous timestep, or
+// nullptr at the first
+template <typename T, typename Math = StandardMath>
+void GRUCellKernel (T* __restrict x, const T* __restrict h, const T* __restrict previous, T* __restrict hidden, size_t n)
+{
+    T* reset_gate  = x;
+    T* update_gate = x + n;
+    T* candidate   = x + 2 * n;
+
+    #pragma omp simd
+    for (size_t j = 0; j < n; j++)
+    {
+        reset_gate  [j] = 1 / (1 + Math::Exp (- (reset_gate  [j] + h [j])));
+        update_gate [j] = 1 / (1 + Math::Exp (- (update_gate [j] + h [j + n])));
+        candidate   [j] = Math::Tanh (candidate [j] + reset_gate [j] * h [j + 2 * n]);
+
+        hidden [j] = (1 - update_gate [j]) * candidate [j] + (previous ? update_gate [j] * previous [j] : 0);
+    };
+};
+
+// Backward GRU cell for one row of the batch. The gradient of the hidden state is hidden_gradient plus the
+// direct term carried from the next timestep in carry, which is replaced with the direct term for the previous
+// one. Writes the gradients of the input projections to dx and of the hidden projections to dh
+template <typename T>
+void GRUCellGradientKernel (const T* __restrict x, const T* __restrict h, const T* __restrict previous, const T* __restrict hidden_gradient, T* __restrict carry, T* __restrict dx, T* __restrict dh, size_t n)
+{
+    const T* reset_gate  = x;
+    const T* update_gate = x + n;
+    const T* candidate   = x + 2 * n;
+
+    #pragma omp simd
+    for (size_t j = 0; j < n; j++)
+    {
+        const T g = hidden_gradient [j] + carry [j];
+        const T p = previous ? previous [j] : 0;
+
+        const T dn = g * (1 - update_gate [j]) * (1 - candidate [j] * candidate [j]);
+        const T dz = g * (p - candidate [j]) * update_gate [j] * (1 - update_gate [j]);
+        const T dr = dn * h [j + 2 * n] * reset_gate [j] * (1 - reset_gate [j]);
+
+        dx [j]         = dr;
+        dx [j + n]     = dz;
+        dx [j + 2 * n] = dn;
+
+        dh [j]         = dr;
+        dh [j + n]     = dz;
+        dh [j + 2 * n] = dn * reset_gate [j];
+
+        carry [j] = g * update_gate [j];
+    };
+};
+
+// Gated recurrent unit layer with the same interface as RecurrentLayer. The reset, update and candidate weights
+// are stacked into one [3 * dimension, dimension] matrix for the input and one for the hidden state, so every
+// timestep is a single GEMM for both gates and the candidate followed by one fused gating pass. Three weight
+// blocks against the LSTM's four make it about a quarter cheaper per timestep
+template <typename T>
+struct GRULayer
+{
+    Tensor <T, 2>* activations;   // hidden states of the last single sequence
+    Tensor <T, 2>* probabilities;
+
+    Tensor <T, 2>* input_weights;  // [3 * dimension, dimension], stacked [reset | update | candidate]
+    Tensor <T, 2>* hidden_weights; // [3 * dimension, dimension]
+    Tensor <T, 2>* hidden_output_weights;
+
+    Tensor <T, 1>* input_biases;  // [3 * dimension]
+    Tensor <T, 1>* hidden_biases; // [3 * dimension], separate because the reset gate scales the candidate's
+    Tensor <T, 1>* output_biases;
+
+    size_t timesteps;
+    size_t dimension;
+
+    float learning_rate;
+
+    bool fast_math; // use the vmath.h approximations for the gates, softmax and the loss
+
+    // Batch buffers laid out [batch][timesteps][width], grown by Reserve and never shrunk
+    size_t capacity = 0;
+
+    T* gates             = nullptr; // 3 * dimension wide, input projections and then gate values
+    T* hidden_projection = nullptr; // 3 * dimension wide
+    T* hidden            = nullptr;
+    T* outputs           = nullptr;
+    T* batch_probabilities = nullptr;
+
+    T* outputs_gradient           = nullptr;
+    T* hidden_gradient            = nullptr;
+    T* gates_gradient             = nullptr; // 3 * dimension wide
+    T* hidden_projection_gradient = nullptr; // 3 * dimension wide
+    T* carry                      = nullptr; // [batch][dimension]
+
+    T* input_weights_gradient;
+    T* hidden_weights_gradient;
+    T* hidden_output_gradient;
+    T* input_biases_gradient;
+    T* hidden_biases_gradient;
+    T* output_biases_gradient;
+
+    GRULayer (size_t dimension, size_t timesteps, float learning_rate = 0.01, bool fast_math = false)
+        : timesteps {timesteps}, dimension {dimension}, learning_rate {learning_rate}, fast_math {fast_math}
+    {
+        size_t dimensions [2] = {timesteps, dimension};
+
+        activations   = new Tensor <T, 2> (dimensions);
+        probabilities = new Tensor <T, 2> (dimensions);
+
+        size_t gate_dimensions [2] = {3 * dimension, dimension};
+        size_t weight_dimensions [2] = {dimension, dimension};
+
+        input_weights         = new Tensor <T, 2> (gate_dimensions);
+        hidden_weights        = new Tensor <T, 2> (gate_dimensions);
+        hidden_output_weights = new Tensor <T, 2> (weight_dimensions);
+
+        input_biases  = new Tensor <T, 1> (3 * dimension);
+        hidden_biases = new Tensor <T, 1> (3 * dimension);
+        output_biases = new Tensor <T, 1> (dimension);
+
+        input_weights         -> template Randomise <std::normal_distribution <T>> ();
+        hidden_weights        -> template Randomise <std::normal_distribution <T>> ();
+        hidden_output_weights -> template Randomise <std::normal_distribution <T>> ();
+
+        input_weights_gradient  = new T [3 * dimension * dimension];
+        hidden_weights_gradient = new T [3 * dimension * dimension];
+        hidden_output_gradient  = new T [dimension * dimension];
+        input_biases_gradient   = new T [3 * dimension];
+        hidden_biases_gradient  = new T [3 * dimension];
+        output_biases_gradient  = new T [dimension];
+
+        Reserve (1);
+    };
+
+    ~GRULayer ()
+    {
+        delete activations;
+        delete probabilities;
+
+        delete input_weights;
+        delete hidden_weights;
+        delete hidden_output_weights;
+
+        delete input_biases;
+        delete hidden_biases;
+        delete output_biases;
+
+        __free_batch ();
+
+        delete [] input_weights_gradient;
+        delete [] hidden_weights_gradient;
+        delete [] hidden_output_gradient;
+        delete [] input_biases_gradient;
+        delete [] hidden_biases_gradient;
+        delete [] output_biases_gradient;
+    };
+
+    GRULayer (const GRULayer&) = delete;
+
+    void __free_batch ()
+    {
+        delete [] gates;
+        delete [] hidden_projection;
+        delete [] hidden;
+        delete [] outputs;
+        delete [] batch_probabilities;
+
+        delete [] outputs_gradient;
+        delete [] hidden_gradient;
+        delete [] gates_gradient;
+        delete [] hidden_projection_gradient;
+        delete [] carry;
+    };
+
+    // Makes room for batches of up to batch sequences
+    void Reserve (size_t batch)
+    {
+        if (batch <= capacity) return;
+
+        __free_batch ();
+
+        const size_t length = batch * timesteps * dimension;
+
+        gates               = new T [3 * length];
+        hidden_projection   = new T [3 * length];
+        hidden              = new T [length];
+        outputs             = new T [length];
+        batch_probabilities = new T [length];
+
+        outputs_gradient           = new T [length];
+        hidden_gradient            = new T [length];
+        gates_gradient             = new T [3 * length];
+        hidden_projection_gradient = new T [3 * length];
+        carry                      = new T [batch * dimension];
+
+        capacity = batch;
+    };
+
+    // Single sequence [timesteps, dimension], leaving the results in activations and probabilities
+    void Propagate (const Tensor <T, 2>& input)
+    {
+        __propagate (input.elements, 1);
+        __copy_sequence ();
+    };
+
+    float BackPropagate (const Tensor <T, 2>& input, const Tensor <T, 2>& expected)
+    {
+        const float loss = __backpropagate (input.elements, expected.elements, 1);
+        __copy_sequence ();
+
+        return loss;
+    };
+
+    // Batch of sequences [batch, timesteps, dimension], leaving the results in the batch buffers
+    void Propagate (const Tensor <T, 3>& input)
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
+
+        __propagate (input.elements, input.dimensions [0]);
+    };
+
+    // Trains on a batch of sequences with one weight update, scaled by the mean over the batch. Returns the mean
+    // loss per sequence
+    float BackPropagate (const Tensor <T, 3>& input, const Tensor <T, 3>& expected)
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
+
+        return __backpropagate (input.elements, expected.elements, input.dimensions [0]);
+    };
+
+    void __copy_sequence ()
+    {
+        const size_t length = timesteps * dimension;
+
+        std::copy (hidden,              hidden              + length, activations   -> elements);
+        std::copy (batch_probabilities, batch_probabilities + length, probabilities -> elements);
+    };
+
+    template <typename Math>
+    void __cells (size_t batch, size_t i)
+    {
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            const size_t row = b * stride + i * D;
+
+            GRUCellKernel <T, Math> (gates + 3 * row, hidden_projection + 3 * row, (i > 0) ? hidden + row - D : nullptr, hidden + row, D);
+        };
+    };
+
+    // The input projection of all gates and the output projection are each one GEMM over all batch * timesteps
+    // rows; only the hidden_weights recurrence runs timestep by timestep
+    void __propagate (const T* input, size_t batch)
+    {
+        Reserve (batch);
+
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+        const size_t rows = batch * timesteps;
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            std::copy (input_biases -> elements, input_biases -> elements + 3 * D, gates + 3 * r * D);
+            std::copy (hidden_biases -> elements, hidden_biases -> elements + 3 * D, hidden_projection + 3 * r * D);
+            std::copy (output_biases -> elements, output_biases -> elements + D, outputs + r * D);
+        };
+
+        Gemm <false, true> (rows, 3 * D, D, input, D, input_weights -> elements, D, gates, 3 * D, true);
+
+        for (size_t i = 0; i < timesteps; i++)
+        {
+            if (i > 0)
+            {
+                Gemm <false, true> (batch, 3 * D, D, hidden + (i - 1) * D, stride, hidden_weights -> elements, D, hidden_projection + 3 * i * D, 3 * stride, true);
+            };
+
+            if (fast_math) __cells <FastMath>     (batch, i);
+            else           __cells <StandardMath> (batch, i);
+        };
+
+        Gemm <false, true> (rows, D, D, hidden, D, hidden_output_weights -> elements, D, outputs, D, true);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            if (fast_math)
+            {
+                SoftmaxKernel <T, FastMath> (outputs + r * D, batch_probabilities + r * D, D);
+            }
+            else
+            {
+                SoftmaxKernel <T> (outputs + r * D, batch_probabilities + r * D, D);
+            };
+        };
+    };
+
+    float __backpropagate (const T* input, const T* expected, size_t batch)
+    {
+        __propagate (input, batch);
+
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+        const size_t rows = batch * timesteps;
+        const size_t length = rows * D;
+
+        float loss = 0.0;
+        const float epsilon = 0.01;
+
+        // Softmax and negative log likelihood together, so the gradient of the outputs is p - expected
+        for (size_t i = 0; i < length; i++)
+        {
+            loss += expected [i] * (fast_math ? FastLog (batch_probabilities [i] + epsilon) : std::log (batch_probabilities [i] + epsilon));
+            outputs_gradient [i] = batch_probabilities [i] - expected [i];
+        };
+
+        Gemm <false, false> (rows, D, D, outputs_gradient, D, hidden_output_weights -> elements, D, hidden_gradient, D);
+
+        std::fill (carry, carry + batch * D, (T)0);
+
+        // Backpropagation Through Time, every sequence of the batch at once
+        for (size_t i = timesteps; i-- > 0;)
+        {
+            if (i + 1 < timesteps)
+            {
+                Gemm <false, false> (batch, D, 3 * D, hidden_projection_gradient + 3 * (i + 1) * D, 3 * stride, hidden_weights -> elements, D, hidden_gradient + i * D, stride, true);
+            };
+
+            for (size_t b = 0; b < batch; b++)
+            {
+                const size_t row = b * stride + i * D;
+
+                GRUCellGradientKernel <T> (gates + 3 * row, hidden_projection + 3 * row, (i > 0) ? hidden + row - D : nullptr, hidden_gradient + row, carry + b * D, gates_gradient + 3 * row, hidden_projection_gradient + 3 * row, D);
+            };
+        };
+
+        // Weight gradients as GEMMs over all rows. The hidden_weights gradient pairs timestep i with the hidden
+        // state of timestep i - 1, so it runs per sequence over the timesteps after the first
+        Gemm <true, false> (D, D, rows, outputs_gradient, D, hidden, D, hidden_output_gradient, D);
+        Gemm <true, false> (3 * D, D, rows, gates_gradient, 3 * D, input, D, input_weights_gradient, D);
+
+        std::fill (hidden_weights_gradient, hidden_weights_gradient + 3 * D * D, (T)0);
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            Gemm <true, false> (3 * D, D, timesteps - 1, hidden_projection_gradient + 3 * (b * stride + D), 3 * D, hidden + b * stride, D, hidden_weights_gradient, D, true);
+        };
+
+        std::fill (input_biases_gradient,  input_biases_gradient  + 3 * D, (T)0);
+        std::fill (hidden_biases_gradient, hidden_biases_gradient + 3 * D, (T)0);
+        std::fill (output_biases_gradient, output_biases_gradient + D,     (T)0);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < 3 * D; j++)
+            {
+                input_biases_gradient  [j] += gates_gradient             [3 * r * D + j];
+                hidden_biases_gradient [j] += hidden_projection_gradient [3 * r * D + j];
+            };
+
+            for (size_t j = 0; j < D; j++)
+            {
+                output_biases_gradient [j] += outputs_gradient [r * D + j];
+            };
+        };
+
+        // Update weights once for the whole batch
+        const float step = learning_rate / batch;
+
+        for (size_t j = 0; j < 3 * D * D; j++)
+        {
+            input_weights  -> elements [j] -= step * input_weights_gradient  [j];
+            hidden_weights -> elements [j] -= step * hidden_weights_gradient [j];
+        };
+
+        for (size_t j = 0; j < D * D; j++)
+        {
+            hidden_output_weights -> elements [j] -= step * hidden_output_gradient [j];
+        };
+
+        for (size_t j = 0; j < 3 * D; j++)
+        {
+            input_biases  -> elements [j] -= step * input_biases_gradient  [j];
+            hidden_biases -> elements [j] -= step * hidden_biases_gradient [j];
+        };
+
+        for (size_t j = 0; j < D; j++)
+        {
+            output_biases -> elements [j] -= step * output_biases_gradient [j];
+        };
+
+        return - loss / batch;
+    };
+};
+
+// Stack of tanh recurrent layers, each dimension wide, with a softmax over dimension classes on top. Layer l
+// at timestep t reads layer l - 1 at t and itself at t - 1:
+//
+//     h [l][t] = tanh (b [l] + h [l - 1][t] W [l]^T + h [l][t - 1] U [l]^T),    h [-1][t] = input [t]
+//
+// so cell (l, t) depends only on (l - 1, t) and (l, t - 1), and every cell on the antidiagonal l + t = d can run
+// at once. With a pool the cells of each antidiagonal are spread over the threads, giving a critical path of
+// timesteps + layers - 1 cells rather than timesteps * layers. Each cell is a GEMM over the whole batch. The
+// backward pass runs the same wavefront in reverse, and every cell pulls its gradient from the cells above and
+// after it, so no two cells write to the same row
+template <typename T>
+struct RecurrentNetwork
+{
+    Tensor <T, 2>** input_weights;  // [layers], [dimension, dimension]
+    Tensor <T, 2>** hidden_weights; // [layers], [dimension, dimension]
+    Tensor <T, 1>** biases;         // [layers]
+
+    Tensor <T, 2>* hidden_output_weights;
+    Tensor <T, 1>* output_biases;
+
+    size_t timesteps;
+    size_t dimension;
+    size_t layers;
+
+    float learning_rate;
+
+    bool fast_math; // use the vmath.h approximations for tanh, softmax and the loss
+
+    ThreadPool* pool = nullptr;
+
+    // Batch buffers laid out [batch][timesteps][dimension], one of each per layer, grown by Reserve
+    size_t capacity = 0;
+    size_t batch = 0;
+
+    T** hidden = nullptr;
+    T** deltas = nullptr; // gradients of the pre-activations
+    T* outputs = nullptr;
+    T* batch_probabilities = nullptr;
+    T* outputs_gradient = nullptr;
+
+    const T* input = nullptr; // the batch being propagated
+
+    T** input_weights_gradient;
+    T** hidden_weights_gradient;
+    T** biases_gradient;
+    T* hidden_output_gradient;
+    T* output_biases_gradient;
+
+    RecurrentNetwork (size_t dimension, size_t timesteps, size_t layers, float learning_rate = 0.01, bool fast_math = false)
+        : timesteps {timesteps}, dimension {dimension}, layers {layers}, learning_rate {learning_rate}, fast_math {fast_math}
+    {
+        size_t weight_dimensions [2] = {dimension, dimension};
+
+        input_weights  = new Tensor <T, 2>* [layers];
+        hidden_weights = new Tensor <T, 2>* [layers];
+        biases         = new Tensor <T, 1>* [layers];
+
+        input_weights_gradient  = new T* [layers];
+        hidden_weights_gradient = new T* [layers];
+        biases_gradient         = new T* [layers];
+
+        for (size_t l = 0; l < layers; l++)
+        {
+            input_weights  [l] = new Tensor <T, 2> (weight_dimensions);
+            hidden_weights [l] = new Tensor <T, 2> (weight_dimensions);
+            biases         [l] = new Tensor <T, 1> (dimension);
+
+            input_weights  [l] -> template Randomise <std::normal_distribution <T>> ();
+            hidden_weights [l] -> template Randomise <std::normal_distribution <T>> ();
+
+            input_weights_gradient  [l] = new T [dimension * dimension];
+            hidden_weights_gradient [l] = new T [dimension * dimension];
+            biases_gradient         [l] = new T [dimension];
+        };
+
+        hidden_output_weights = new Tensor <T, 2> (weight_dimensions);
+        output_biases         = new Tensor <T, 1> (dimension);
+
+        hidden_output_weights -> template Randomise <std::normal_distribution <T>> ();
+
+        hidden_output_gradient = new T [dimension * dimension];
+        output_biases_gradient = new T [dimension];
+
+        hidden = new T* [layers]{};
+        deltas = new T* [layers]{};
+
+        Reserve (1);
+    };
+
+    ~RecurrentNetwork ()
+    {
+        for (size_t l = 0; l < layers; l++)
+        {
+            delete input_weights  [l];
+            delete hidden_weights [l];
+            delete biases         [l];
+
+            delete [] input_weights_gradient  [l];
+            delete [] hidden_weights_gradient [l];
+            delete [] biases_gradient         [l];
+        };
+
+        delete [] input_weights;
+        delete [] hidden_weights;
+        delete [] biases;
+
+        delete [] input_weights_gradient;
+        delete [] hidden_weights_gradient;
+        delete [] biases_gradient;
+
+        delete hidden_output_weights;
+        delete output_biases;
+
+        delete [] hidden_output_gradient;
+        delete [] output_biases_gradient;
+
+        __free_batch ();
+
+        delete [] hidden;
+        delete [] deltas;
+    };
+
+    RecurrentNetwork (const RecurrentNetwork&) = delete;
+
+    // Runs the cells of each antidiagonal on the pool; nullptr runs them on the calling thread. The results do
+    // not depend on the number of threads
+    void UseThreads (ThreadPool* pool)
+    {
+        this -> pool = pool;
+    };
+
+    void __free_batch ()
+    {
+        for (size_t l = 0; l < layers; l++)
+        {
+            delete [] hidden [l];
+            delete [] deltas [l];
+        };
+
+        delete [] outputs;
+        delete [] batch_probabilities;
+        delete [] outputs_gradient;
+    };
+
+    // Makes room for batches of up to batch sequences
+    void Reserve (size_t batch)
+    {
+        if (batch <= capacity) return;
+
+        __free_batch ();
+
+        const size_t length = batch * timesteps * dimension;
+
+        for (size_t l = 0; l < layers; l++)
+        {
+            hidden [l] = new T [length];
+            deltas [l] = new T [length];
+        };
+
+        outputs             = new T [length];
+        batch_probabilities = new T [length];
+        outputs_gradient    = new T [length];
+
+        capacity = batch;
+    };
+
+    // Calls cell (l, t) for every cell of the grid, one antidiagonal at a time, first to last or last to first
+    void __wavefront (const std::function <void (size_t, size_t)>& cell, bool reverse)
+    {
+        const size_t diagonals = timesteps + layers - 1;
+
+        for (size_t k = 0; k < diagonals; k++)
+        {
+            const size_t d = reverse ? diagonals - 1 - k : k;
+            const size_t first = (d >= timesteps) ? d - timesteps + 1 : 0;
+            const size_t last = std::min (d, layers - 1);
+
+            const std::function <void (size_t)> task = [&] (size_t i) { cell (first + i, d - first - i); };
+
+            if (pool && last > first)
+            {
+                pool -> Run (last - first + 1, task);
+            }
+            else
+            {
+                for (size_t i = 0; i <= last - first; i++) task (i);
+            };
+        };
+    };
+
+    template <typename Math>
+    void __activate_cell (T* x, size_t rows, size_t stride)
+    {
+        for (size_t b = 0; b < rows; b++)
+        {
+            T* row = x + b * stride;
+
+            #pragma omp simd
+            for (size_t j = 0; j < dimension; j++)
+            {
+                row [j] = Math::Tanh (row [j]);
+            };
+        };
+    };
+
+    void __forward_cell (size_t l, size_t t)
+    {
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+
+        const T* below = (l == 0) ? input : hidden [l - 1];
+        T* h = hidden [l] + t * D;
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            std::copy (biases [l] -> elements, biases [l] -> elements + D, h + b * stride);
+        };
+
+        Gemm <false, true> (batch, D, D, below + t * D, stride, input_weights [l] -> elements, D, h, stride, true);
+
+        if (t > 0)
+        {
+            Gemm <false, true> (batch, D, D, h - D, stride, hidden_weights [l] -> elements, D, h, stride, true);
+        };
+
+        if (fast_math) __activate_cell <FastMath>     (h, batch, stride);
+        else           __activate_cell <StandardMath> (h, batch, stride);
+    };
+
+    void __backward_cell (size_t l, size_t t)
+    {
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+
+        T* delta = deltas [l] + t * D;
+        const T* h = hidden [l] + t * D;
+
+        // Gradient of h [l][t], from the layer above at t and this layer at t + 1
+        if (l + 1 == layers)
+        {
+            Gemm <false, false> (batch, D, D, outputs_gradient + t * D, stride, hidden_output_weights -> elements, D, delta, stride);
+        }
+        else
+        {
+            Gemm <false, false> (batch, D, D, deltas [l + 1] + t * D, stride, input_weights [l + 1] -> elements, D, delta, stride);
+        };
+
+        if (t + 1 < timesteps)
+        {
+            Gemm <false, false> (batch, D, D, delta + D, stride, hidden_weights [l] -> elements, D, delta, stride, true);
+        };
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            #pragma omp simd
+            for (size_t j = 0; j < D; j++)
+            {
+                delta [b * stride + j] *= 1 - h [b * stride + j] * h [b * stride + j];
+            };
+        };
+    };
+
+    // Batch of sequences [batch, timesteps, dimension]; the results are left in batch_probabilities
+    void Propagate (const Tensor <T, 3>& input)
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
+
+        __propagate (input.elements, input.dimensions [0]);
+    };
+
+    // Trains on a batch of sequences with one weight update, scaled by the mean over the batch. Returns the mean
+    // loss per sequence
+    float BackPropagate (const Tensor <T, 3>& input, const Tensor <T, 3>& expected)
+    {
+        assert (input.dimensions [1] == timesteps && input.dimensions [2] == dimension);
+
+        return __backpropagate (input.elements, expected.elements, input.dimensions [0]);
+    };
+
+    void __propagate (const T* input, size_t batch)
+    {
+        Reserve (batch);
+
+        this -> input = input;
+        this -> batch = batch;
+
+        const size_t D = dimension;
+        const size_t rows = batch * timesteps;
+
+        __wavefront ([this] (size_t l, size_t t) { __forward_cell (l, t); }, false);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            std::copy (output_biases -> elements, output_biases -> elements + D, outputs + r * D);
+        };
+
+        Gemm <false, true> (rows, D, D, hidden [layers - 1], D, hidden_output_weights -> elements, D, outputs, D, true);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            if (fast_math)
+            {
+                SoftmaxKernel <T, FastMath> (outputs + r * D, batch_probabilities + r * D, D);
+            }
+            else
+            {
+                SoftmaxKernel <T> (outputs + r * D, batch_probabilities + r * D, D);
+            };
+        };
+    };
+
+    // Gradients of layer l's weights from its deltas, as GEMMs over all batch * timesteps rows
+    void __layer_gradients (size_t l)
+    {
+        const size_t D = dimension;
+        const size_t stride = timesteps * D;
+        const size_t rows = batch * timesteps;
+
+        const T* below = (l == 0) ? input : hidden [l - 1];
+
+        Gemm <true, false> (D, D, rows, deltas [l], D, below, D, input_weights_gradient [l], D);
+
+        // Pairs timestep t with the hidden state at t - 1, so runs per sequence over the timesteps after the first
+        std::fill (hidden_weights_gradient [l], hidden_weights_gradient [l] + D * D, (T)0);
+
+        for (size_t b = 0; b < batch; b++)
+        {
+            Gemm <true, false> (D, D, timesteps - 1, deltas [l] + b * stride + D, D, hidden [l] + b * stride, D, hidden_weights_gradient [l], D, true);
+        };
+
+        std::fill (biases_gradient [l], biases_gradient [l] + D, (T)0);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < D; j++)
+            {
+                biases_gradient [l][j] += deltas [l][r * D + j];
+            };
+        };
+    };
+
+    float __backpropagate (const T* input, const T* expected, size_t batch)
+    {
+        __propagate (input, batch);
+
+        const size_t D = dimension;
+        const size_t rows = batch * timesteps;
+        const size_t length = rows * D;
+
+        float loss = 0.0;
+        const float epsilon = 0.01;
+
+        // Softmax and negative log likelihood together, so the gradient of the outputs is p - expected
+        for (size_t i = 0; i < length; i++)
+        {
+            loss += expected [i] * (fast_math ? FastLog (batch_probabilities [i] + epsilon) : std::log (batch_probabilities [i] + epsilon));
+            outputs_gradient [i] = batch_probabilities [i] - expected [i];
+        };
+
+        __wavefront ([this] (size_t l, size_t t) { __backward_cell (l, t); }, true);
+
+        // The layers' weight gradients are independent of each other
+        if (pool)
+        {
+            pool -> Run (layers, [this] (size_t l) { __layer_gradients (l); });
+        }
+        else
+        {
+            for (size_t l = 0; l < layers; l++) __layer_gradients (l);
+        };
+
+        Gemm <true, false> (D, D, rows, outputs_gradient, D, hidden [layers - 1], D, hidden_output_gradient, D);
+
+        std::fill (output_biases_gradient, output_biases_gradient + D, (T)0);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < D; j++)
+            {
+                output_biases_gradient [j] += outputs_gradient [r * D + j];
+            };
+        };
+
+        // Update weights once for the whole batch
+        const float step = learning_rate / batch;
+
+        for (size_t l = 0; l < layers; l++)
+        {
+            for (size_t j = 0; j < D * D; j++)
+            {
+                input_weights  [l] -> elements [j] -= step * input_weights_gradient  [l][j];
+                hidden_weights [l] -> elements [j] -= step * hidden_weights_gradient [l][j];
+            };
+
+            for (size_t j = 0; j < D; j++)
+            {
+                biases [l] -> elements [j] -= step * biases_gradient [l][j];
+            };
+        };
+
+        for (size_t j = 0; j < D * D; j++)
+        {
+            hidden_output_weights -> elements [j] -= step * hidden_output_gradient [j];
+        };
+
+        for (size_t j = 0; j < D; j++)
+        {
+            output_biases -> elements [j] -= step * output_biases_gradient [j];
+        };
+
+        return - loss / batch;
+    };
+};
+
+// Target for the working set of one attention tile: a query block, a key and a value block and the score tile
+constexpr size_t AttentionTileBytes = 128 * 1024;
+
+// Multi-head self-attention over one sequence [length, dimension], with the query, key, value and output
+// projections as [dimension, dimension] Tensors and heads of dimension / heads columns each. Attention is computed
+// tile by tile with an online softmax, so the [length, length] score matrix is never stored: each query block keeps
+// a running maximum, normaliser and weighted sum as it walks the key blocks, and only the log-sum-exp of every row
+// is kept for the backward pass, which recomputes the scores tile by tile. Memory grows linearly with length. The
+// work is split into tasks of one head and one query (or key) block, run on the pool if there is one
+template <typename T>
+struct MultiHeadAttentionLayer
+{
+    Tensor <T, 2>* query_weights;
+    Tensor <T, 2>* key_weights;
+    Tensor <T, 2>* value_weights;
+    Tensor <T, 2>* output_weights;
+
+    size_t dimension;
+    size_t heads;
+    size_t head_dimension;
+    size_t block; // rows in a query or key block
+
+    float learning_rate;
+
+    bool causal;    // each position attends only to itself and earlier ones
+    bool fast_math; // use the vmath.h approximation for exp
+
+    ThreadPool* pool = nullptr;
+
+    // Buffers of capacity rows of dimension values, grown by Reserve. length is the sequence last propagated
+    size_t capacity = 0;
+    size_t length = 0;
+
+    const T* input = nullptr;
+
+    T* queries   = nullptr;
+    T* keys      = nullptr;
+    T* values    = nullptr;
+    T* attention = nullptr; // heads side by side, before the output projection
+    T* output    = nullptr;
+    T* logsumexp = nullptr; // [heads][capacity]
+
+    T* output_gradient    = nullptr;
+    T* attention_gradient = nullptr;
+    T* queries_gradient   = nullptr;
+    T* keys_gradient      = nullptr;
+    T* values_gradient    = nullptr;
+    T* row_dot            = nullptr; // [heads][capacity], attention_gradient . attention per head and row
+
+    T* query_weights_gradient;
+    T* key_weights_gradient;
+    T* value_weights_gradient;
+    T* output_weights_gradient;
+
+    MultiHeadAttentionLayer (size_t dimension, size_t heads, float learning_rate = 0.01, bool causal = false, bool fast_math = false)
+        : dimension {dimension}, heads {heads}, head_dimension {dimension / heads}, learning_rate {learning_rate}, causal {causal}, fast_math {fast_math}
+    {
+        assert (dimension % heads == 0);
+
+        // Largest power of two block up to 128 whose tile fits the target
+        block = 128;
+
+        while (block > 8 && (3 * block * head_dimension + block * block) * sizeof (T) > AttentionTileBytes)
+        {
+            block /= 2;
+        };
+
+        size_t weight_dimensions [2] = {dimension, dimension};
+
+        query_weights  = new Tensor <T, 2> (weight_dimensions);
+        key_weights    = new Tensor <T, 2> (weight_dimensions);
+        value_weights  = new Tensor <T, 2> (weight_dimensions);
+        output_weights = new Tensor <T, 2> (weight_dimensions);
+
+        // Four projections in series vanish at Randomise's 1/n, and drawing each from its own generator would
+        // make the queries equal the keys, so all four come from one stream at 1/sqrt(dimension)
+        std::mt19937 generator (SEED);
+        std::normal_distribution <T> distribution (0.0, 1 / std::sqrt ((T)dimension));
+
+        for (Tensor <T, 2>* weights : {query_weights, key_weights, value_weights, output_weights})
+        {
+            for (size_t j = 0; j < weights -> length; j++) weights -> elements [j] = distribution (generator);
+        };
+
+        query_weights_gradient  = new T [dimension * dimension];
+        key_weights_gradient    = new T [dimension * dimension];
+        value_weights_gradient  = new T [dimension * dimension];
+        output_weights_gradient = new T [dimension * dimension];
+    };
+
+    ~MultiHeadAttentionLayer ()
+    {
+        delete query_weights;
+        delete key_weights;
+        delete value_weights;
+        delete output_weights;
+
+        delete [] query_weights_gradient;
+        delete [] key_weights_gradient;
+        delete [] value_weights_gradient;
+        delete [] output_weights_gradient;
+
+        __free_buffers ();
+    };
+
+    MultiHeadAttentionLayer (const MultiHeadAttentionLayer&) = delete;
+
+    // Runs the head and block tasks on the pool; nullptr runs them on the calling thread. Every task writes its
+    // own rows, so the results do not depend on the number of threads
+    void UseThreads (ThreadPool* pool)
+    {
+        this -> pool = pool;
+    };
+
+    void __free_buffers ()
+    {
+        delete [] queries;
+        delete [] keys;
+        delete [] values;
+        delete [] attention;
+        delete [] output;
+        delete [] logsumexp;
+
+        delete [] output_gradient;
+        delete [] attention_gradient;
+        delete [] queries_gradient;
+        delete [] keys_gradient;
+        delete [] values_gradient;
+        delete [] row_dot;
+    };
+
+    // Makes room for sequences of up to length positions
+    void Reserve (size_t length)
+    {
+        if (length <= capacity) return;
+
+        __free_buffers ();
+
+        const size_t size = length * dimension;
+
+        queries   = new T [size];
+        keys      = new T [size];
+        values    = new T [size];
+        attention = new T [size];
+        output    = new T [size];
+        logsumexp = new T [heads * length];
+
+        output_gradient    = new T [size];
+        attention_gradient = new T [size];
+        queries_gradient   = new T [size];
+        keys_gradient      = new T [size];
+        values_gradient    = new T [size];
+        row_dot            = new T [heads * length];
+
+        capacity = length;
+    };
+
+    size_t __blocks () const
+    {
+        return (length + block - 1) / block;
+    };
+
+    void __run (size_t tasks, const std::function <void (size_t)>& task)
+    {
+        if (pool)
+        {
+            pool -> Run (tasks, task);
+        }
+        else
+        {
+            for (size_t i = 0; i < tasks; i++) task (i);
+        };
+    };
+
+    // Scores of a query block against a key block, scaled, with positions after the query masked out when causal
+    void __scores (size_t h, size_t first, size_t rows, size_t key_first, size_t columns, T* s) const
+    {
+        const T scale = 1 / std::sqrt ((T)head_dimension);
+
+        Gemm <false, true> (rows, columns, head_dimension, queries + first * dimension + h * head_dimension, dimension, keys + key_first * dimension + h * head_dimension, dimension, s, block);
+
+        for (size_t i = 0; i < rows; i++)
+        {
+            T* row = s + i * block;
+
+            #pragma omp simd
+            for (size_t c = 0; c < columns; c++)
+            {
+                row [c] = (causal && key_first + c > first + i) ? -INFINITY : row [c] * scale;
+            };
+        };
+    };
+
+    // One head over one query block: walks the key blocks keeping the running maximum m, normaliser l and
+    // unnormalised weighted sum of values of each row, rescaling them whenever the maximum grows
+    template <typename Math>
+    void __forward_task (size_t h, size_t b)
+    {
+        const size_t first = b * block;
+        const size_t rows = std::min (block, length - first);
+        const size_t last = causal ? b : __blocks () - 1;
+
+        T* s = new T [block * block];
+        T* sum = new T [block * head_dimension]{};
+        T* m = new T [block];
+        T* l = new T [block]{};
+
+        std::fill (m, m + block, -INFINITY);
+
+        for (size_t k = 0; k <= last; k++)
+        {
+            const size_t key_first = k * block;
+            const size_t columns = std::min (block, length - key_first);
+
+            __scores (h, first, rows, key_first, columns, s);
+
+            for (size_t i = 0; i < rows; i++)
+            {
+                T* row = s + i * block;
+                T maximum = m [i];
+
+                for (size_t c = 0; c < columns; c++) maximum = std::max (maximum, row [c]);
+
+                const T correction = Math::Exp (m [i] - maximum);
+                T total = 0;
+
+                #pragma omp simd reduction (+:total)
+                for (size_t c = 0; c < columns; c++)
+                {
+                    row [c] = Math::Exp (row [c] - maximum);
+                    total += row [c];
+                };
+
+                l [i] = l [i] * correction + total;
+                m [i] = maximum;
+
+                #pragma omp simd
+                for (size_t d = 0; d < head_dimension; d++)
+                {
+                    sum [i * head_dimension + d] *= correction;
+                };
+            };
+
+            Gemm <false, false> (rows, head_dimension, columns, s, block, values + key_first * dimension + h * head_dimension, dimension, sum, head_dimension, true);
+        };
+
+        for (size_t i = 0; i < rows; i++)
+        {
+            T* out = attention + (first + i) * dimension + h * head_dimension;
+            const T scale = 1 / l [i];
+
+            for (size_t d = 0; d < head_dimension; d++)
+            {
+                out [d] = sum [i * head_dimension + d] * scale;
+            };
+
+            logsumexp [h * length + first + i] = m [i] + std::log (l [i]);
+        };
+
+        delete [] s;
+        delete [] sum;
+        delete [] m;
+        delete [] l;
+    };
+
+    // Probabilities of a tile from its scores and the rows' log-sum-exp, then the gradient of the scaled scores,
+    // P * (dP - rowdot) * scale, in dp
+    template <typename Math>
+    void __tile_gradient (size_t h, size_t first, size_t rows, size_t key_first, size_t columns, T* s, T* dp) const
+    {
+        const T scale = 1 / std::sqrt ((T)head_dimension);
+
+        __scores (h, first, rows, key_first, columns, s);
+
+        Gemm <false, true> (rows, columns, head_dimension, attention_gradient + first * dimension + h * head_dimension, dimension, values + key_first * dimension + h * head_dimension, dimension, dp, block);
+
+        for (size_t i = 0; i < rows; i++)
+        {
+            T* p = s + i * block;
+            T* g = dp + i * block;
+
+            const T lse = logsumexp [h * length + first + i];
+            const T dot = row_dot [h * length + first + i];
+
+            #pragma omp simd
+            for (size_t c = 0; c < columns; c++)
+            {
+                p [c] = Math::Exp (p [c] - lse);
+                g [c] = p [c] * (g [c] - dot) * scale;
+            };
+        };
+    };
+
+    // Gradients of the keys and values of one head and key block, summed over the query blocks that see it
+    template <typename Math>
+    void __key_task (size_t h, size_t k)
+    {
+        const size_t key_first = k * block;
+        const size_t columns = std::min (block, length - key_first);
+
+        T* s = new T [block * block];
+        T* dp = new T [block * block];
+
+        T* dk = keys_gradient + key_first * dimension + h * head_dimension;
+        T* dv = values_gradient + key_first * dimension + h * head_dimension;
+
+        for (size_t c = 0; c < columns; c++)
+        {
+            std::fill (dk + c * dimension, dk + c * dimension + head_dimension, (T)0);
+            std::fill (dv + c * dimension, dv + c * dimension + head_dimension, (T)0);
+        };
+
+        for (size_t b = causal ? k : 0; b < __blocks (); b++)
+        {
+            const size_t first = b * block;
+            const size_t rows = std::min (block, length - first);
+
+            __tile_gradient <Math> (h, first, rows, key_first, columns, s, dp);
+
+            Gemm <true, false> (columns, head_dimension, rows, s, block, attention_gradient + first * dimension + h * head_dimension, dimension, dv, dimension, true);
+            Gemm <true, false> (columns, head_dimension, rows, dp, block, queries + first * dimension + h * head_dimension, dimension, dk, dimension, true);
+        };
+
+        delete [] s;
+        delete [] dp;
+    };
+
+    // Gradient of the queries of one head and query block, summed over the key blocks it sees
+    template <typename Math>
+    void __query_task (size_t h, size_t b)
+    {
+        const size_t first = b * block;
+        const size_t rows = std::min (block, length - first);
+        const size_t last = causal ? b : __blocks () - 1;
+
+        T* s = new T [block * block];
+        T* dp = new T [block * block];
+
+        T* dq = queries_gradient + first * dimension + h * head_dimension;
+
+        for (size_t i = 0; i < rows; i++)
+        {
+            std::fill (dq + i * dimension, dq + i * dimension + head_dimension, (T)0);
+        };
+
+        for (size_t k = 0; k <= last; k++)
+        {
+            const size_t key_first = k * block;
+            const size_t columns = std::min (block, length - key_first);
+
+            __tile_gradient <Math> (h, first, rows, key_first, columns, s, dp);
+
+            Gemm <false, false> (rows, head_dimension, columns, dp, block, keys + key_first * dimension + h * head_dimension, dimension, dq, dimension, true);
+        };
+
+        delete [] s;
+        delete [] dp;
+    };
+
+    // Sequence [length, dimension], leaving the result in output
+    void Propagate (const Tensor <T, 2>& input)
+    {
+        assert (input.dimensions [1] == dimension);
+
+        __propagate (input.elements, input.dimensions [0]);
+    };
+
+    void __propagate (const T* input, size_t length)
+    {
+        Reserve (length);
+
+        this -> input = input;
+        this -> length = length;
+
+        const size_t D = dimension;
+
+        Gemm <false, true> (length, D, D, input, D, query_weights -> elements, D, queries, D);
+        Gemm <false, true> (length, D, D, input, D, key_weights   -> elements, D, keys,    D);
+        Gemm <false, true> (length, D, D, input, D, value_weights -> elements, D, values,  D);
+
+        const size_t blocks = __blocks ();
+
+        __run (heads * blocks, [&] (size_t task)
+        {
+            if (fast_math) __forward_task <FastMath>     (task / blocks, task % blocks);
+            else           __forward_task <StandardMath> (task / blocks, task % blocks);
+        });
+
+        Gemm <false, true> (length, D, D, attention, D, output_weights -> elements, D, output, D);
+    };
+
+    // Backward pass for the sequence last propagated, from the gradient of output. Writes the gradient of the input
+    // to input_gradient unless it is nullptr, then takes a gradient step
+    void Backward (const T* output_gradient, T* input_gradient = nullptr)
+    {
+        const size_t D = dimension;
+        const size_t blocks = __blocks ();
+
+        Gemm <false, false> (length, D, D, output_gradient, D, output_weights -> elements, D, attention_gradient, D);
+        Gemm <true, false> (D, D, length, output_gradient, D, attention, D, output_weights_gradient, D);
+
+        for (size_t h = 0; h < heads; h++)
+        {
+            for (size_t i = 0; i < length; i++)
+            {
+                const T* a = attention + i * D + h * head_dimension;
+                const T* g = attention_gradient + i * D + h * head_dimension;
+                T dot = 0;
+
+                for (size_t d = 0; d < head_dimension; d++) dot += a [d] * g [d];
+
+                row_dot [h * length + i] = dot;
+            };
+        };
+
+        // Keys and values are summed over query blocks and queries over key blocks, so each gets its own pass
+        // rather than tasks adding into each other's rows
+        __run (heads * blocks, [&] (size_t task)
+        {
+            if (fast_math) __key_task <FastMath>     (task / blocks, task % blocks);
+            else           __key_task <StandardMath> (task / blocks, task % blocks);
+        });
+
+        __run (heads * blocks, [&] (size_t task)
+        {
+            if (fast_math) __query_task <FastMath>     (task / blocks, task % blocks);
+            else           __query_task <StandardMath> (task / blocks, task % blocks);
+        });
+
+        Gemm <true, false> (D, D, length, queries_gradient, D, input, D, query_weights_gradient, D);
+        Gemm <true, false> (D, D, length, keys_gradient,    D, input, D, key_weights_gradient,   D);
+        Gemm <true, false> (D, D, length, values_gradient,  D, input, D, value_weights_gradient, D);
+
+        if (input_gradient)
+        {
+            Gemm <false, false> (length, D, D, queries_gradient, D, query_weights -> elements, D, input_gradient, D);
+            Gemm <false, false> (length, D, D, keys_gradient,    D, key_weights   -> elements, D, input_gradient, D, true);
+            Gemm <false, false> (length, D, D, values_gradient,  D, value_weights -> elements, D, input_gradient, D, true);
+        };
+
+        for (size_t j = 0; j < D * D; j++)
+        {
+            query_weights  -> elements [j] -= learning_rate * query_weights_gradient  [j];
+            key_weights    -> elements [j] -= learning_rate * key_weights_gradient    [j];
+            value_weights  -> elements [j] -= learning_rate * value_weights_gradient  [j];
+            output_weights -> elements [j] -= learning_rate * output_weights_gradient [j];
+        };
+    };
+
+    // Trains towards expected [length, dimension] on the mean squared error, returning the loss
+    float BackPropagate (const Tensor <T, 2>& input, const Tensor <T, 2>& expected)
+    {
+        Propagate (input);
+
+        const size_t size = length * dimension;
+        float loss = 0.0;
+
+        for (size_t i = 0; i < size; i++)
+        {
+            const T difference = expected.elements [i] - output [i];
+
+            loss += difference * difference;
+            output_gradient [i] = - 2 * difference / size;
+        };
+
+        Backward (output_gradient);
+
+        return loss / size;
+    };
+};
+
+template <typename T, size_t Dim, bool Chns>
+struct ConvolutionLayer 
+{
+    Tensor <T, Dim + Chns>* output;
+    Tensor <T, Dim + (2 * Chns)>* kernel;
+
+    ConvolutionType type;
+    uint downsample;
+
+    const float base_learning_rate;
+    float learning_rate;
+
+    const float regularisation_factor;
+
+    ConvolutionLayer 
+    (
+        Tensor <T, Dim + (2 * Chns)>* initial_kernel, 
+        size_t input_dim [Dim + Chns], 
+        size_t output_dim [Dim + Chns],
+        size_t kernel_dim [Dim + (2 * Chns)], 
+        NormalisedRandom <1>* r, 
+        ConvolutionType type,
+        uint downsample,
+        float base_learning_rate = 1.0,
+        float regularisation_factor = 0.001
+    )
+        :   type {type}, 
+            downsample {downsample}, 
+            base_learning_rate {base_learning_rate}, 
+            learning_rate {base_learning_rate}, 
+            regularisation_factor {regularisation_factor}
+    {
+        output = new Tensor <T, Dim + Chns> (output_dim);
+        kernel = new Tensor <T, Dim + (2 * Chns)> (kernel_dim);
+
+        if (initial_kernel == nullptr)
+        {
+            Iterate <NormalisedRandom <1>*, Tensor <T, Dim + (2 * Chns)>*, Dim + (2 * Chns)> (InitialiseKernel <T, Dim, Chns>, r, kernel, kernel_dim);
+        }
+        else 
+        {
+            kernel -> SetElements (initial_kernel);
+        };
+    };
+
+    void Propagate (const Tensor <T, Dim + Chns>& input) 
+    {
+        Convolve <T, Dim, Chns, false> (input, (*kernel), (*output), type, downsample);
+    };
+
+    float BackPropagate (const Tensor <T, Dim + Chns>& input, const Tensor <T, Dim + Chns>& expected) 
+    {
+        Propagate (input);
+
+        Tensor <T, Dim + Chns> input_gradient (input.dimensions);
+        Tensor <T, Dim + Chns> output_gradient (output -> dimensions);
+        Tensor <T, Dim + (2 * Chns)> kernel_gradient (kernel -> dimensions);
+
+        // Tensor <T, Dim + Chns> flipped_input = input.Copy ();
+        // Tensor <T, Dim + (2 * Chns)> flipped_kernel = (*kernel).Copy ();
+
+        // flipped_input.Rotate ();
+        // flipped_kernel.Flip ();
+
+        MeanSquaredErrorGradient <T, Dim + Chns> (*output, expected, output_gradient);
+        const float loss = MeanSquaredError <T, Dim + Chns> (*output, expected);
+        // float loss = MeanSquaredError <T, Dim + Chns> (*output, expected) + Regulariser <T, Dim + (2 * Chns)> (*kernel);
+
+        // Convolve <T, Dim, Chns, false> (output_gradient, (*kernel), input_gradient, type, downsample);
+        // expected.Print ("expected");
+        // (*output).Print ("output");
+
+        // output_gradient.Print ("output gradient");
+
+        // TODO: 
         // output_gradient.Rotate ();
         // ? some kind of issue with orientation - seems to be updating the wrong indexes
         // ? do the maths on this
@@ -965,6 +3639,42 @@ struct ConvolutionLayer
 };
 
 
+// Caller-owned working memory for Network::Infer: two ping-pong buffers of width * batch floats each,
+// so concurrent callers never touch the activations stored in the layers
+struct InferenceScratch
+{
+    float* buffers [2] = {nullptr, nullptr};
+    size_t capacity = 0;
+
+    InferenceScratch () {};
+
+    InferenceScratch (size_t width, size_t batch = 1)
+    {
+        Reserve (width, batch);
+    };
+
+    ~InferenceScratch ()
+    {
+        delete [] buffers [0];
+        delete [] buffers [1];
+    };
+
+    InferenceScratch (const InferenceScratch&) = delete;
+
+    void Reserve (size_t width, size_t batch = 1)
+    {
+        if (width * batch <= capacity) return;
+
+        capacity = width * batch;
+
+        for (uint i = 0; i < 2; i++)
+        {
+            delete [] buffers [i];
+            buffers [i] = new float [capacity];
+        };
+    };
+};
+
 template <size_t depth>
 struct Layer
 {
@@ -973,10 +3683,11 @@ struct Layer
     struct { size_t M, N; } size;
 
     float* activations;
+    float* derivatives; // derivative of the activation at x, written alongside the activations
     float* x;
 
-    activation_fn fn;
-    activation_fn fn_prime;
+    ActivationType activation;
+    bool fast_math = false; // use the vmath.h approximations in the activation kernels
     
 
     // Constructor
@@ -984,15 +3695,16 @@ struct Layer
     (
         float** p, float* b, 
         size_t M, size_t N, 
-        activation_fn f, activation_fn f_prime, 
+        ActivationType activation, 
         NormalisedRandom <depth>* r, int layer_depth
     ) 
-        : fn (f), fn_prime (f_prime)
+        : activation (activation)
     {
         size.M = M;
         size.N = N;
 
         activations = new float [M]();
+        derivatives = new float [M]();
         x = new float [M]();
 
         weights = new float* [M];
@@ -1041,19 +3753,216 @@ struct Layer
         delete [] x;
         delete [] biases; //? is this a problem? maybe
         delete [] activations;
+        delete [] derivatives;
     };
 
     void SetActivations (float input [])
+    {
+        Forward (input, x, activations, derivatives);
+    };
+
+    // Training forward pass into caller-owned buffers of M floats each. With shared, the parameters are read with
+    // relaxed atomic loads, as Hogwild threads update them concurrently
+    template <bool shared = false>
+    void Forward (const float input [], float x [], float activations [], float derivatives []) const
+    {
+        size_t M = size.M;
+        size_t N = size.N;
+
+        for (int i = 0; i < M; i++) 
+        {
+            if constexpr (shared)
+            {
+                x [i] = RelaxedWeightedSum (input, weights [i], RelaxedLoad (biases + i), N);
+            }
+            else
+            {
+                x [i] = WeightedSum (input, weights [i], biases [i], N);
+            };
+        };
+
+        Activate (activation, x, activations, derivatives, M, fast_math);
+    };
+
+    // Training backward pass for one sample. g holds the gradient of the loss with respect to the activations and is
+    // overwritten with the gradient with respect to the nets; mean_batch * the weight and bias gradients are
+    // accumulated, and the gradient with respect to input is written to previous unless it is nullptr. shared as for
+    // Forward
+    template <bool shared = false>
+    void Backward 
+    (
+        const float input [], const float derivatives [], float g [], 
+        float weight_gradients [], float bias_gradients [], float previous [], float mean_batch
+    ) const
+    {
+        size_t M = size.M;
+        size_t N = size.N;
+
+        for (int j = 0; j < M; j++) 
+        {
+            g [j] *= derivatives [j];
+        };
+
+        // The regulariser gradient is applied as weight decay by the optimisers
+        for (int j = 0; j < M; j++)
+        {
+            bias_gradients [j] += mean_batch * g [j];
+
+            for (int k = 0; k < N; k++)
+            {
+                weight_gradients [j * N + k] += mean_batch * (g [j] * input [k]);
+            };
+        };
+
+        if (previous == nullptr) return;
+
+        std::fill (previous, previous + N, 0.0f);
+
+        // Row by row, so each row of weights is read once in order; the sums run over j in the same order either way
+        for (int j = 0; j < M; j++)
+        {
+            const float gradient = g [j];
+            const float* row = weights [j];
+
+            for (int k = 0; k < N; k++)
+            {
+                previous [k] += gradient * (shared ? RelaxedLoad (row + k) : row [k]);
+            };
+        };
+    };
+
+    // Inference only: writes the activations for a batch of inputs (rows of N) into output (rows of M)
+    // without storing x or the derivatives, and without modifying the layer
+    void Apply (const float input [], float output [], size_t batch = 1) const
     {
         size_t M = size.M;
         size_t N = size.N;
 
+        // Each row of weights is reused across the whole batch while it is in cache
         for (int i = 0; i < M; i++) 
         {
-            x [i] = WeightedSum (input, weights [i], biases [i], N);
-            activations [i] = fn (x [i]);
+            for (size_t b = 0; b < batch; b++)
+            {
+                output [b * M + i] = WeightedSum (input + b * N, weights [i], biases [i], N);
+            };
+        };
+
+        Activate (activation, output, output, M * batch, fast_math);
+    };
+};
+
+// Number of parameters summed per task when data-parallel gradients are reduced
+constexpr size_t ReductionBlock = 4096;
+
+// Buffers for one forward and backward pass: the nets, activations and activation derivatives of every layer, the
+// post-output-function result, the gradients, and two rows for the back-propagated error. The Network's own workspace
+// borrows its layers' buffers and its shared gradients; each data-parallel shard owns a private one.
+template <size_t depth>
+struct Workspace
+{
+    float* x [depth];
+    float* activations [depth];
+    float* derivatives [depth];
+    float* output;
+
+    float* gradients; // each layer's weight gradients (M * N) followed by its bias gradients (M), as one block
+    float* weight_gradients [depth];
+    float* bias_gradients [depth];
+    size_t parameter_count;
+
+    float* errors [2];
+    const bool owner;
+
+    float loss = 0.0; // a data-parallel shard's loss over its slice of the last minibatch
+
+    // Forward and Backward on this workspace read the layers' parameters with relaxed atomic loads, for Hogwild
+    // threads that update them concurrently
+    bool shared = false;
+
+    // Private buffers for a network of the given dimensions
+    Workspace (const size_t dimensions [depth + 1]) 
+        : owner {true}
+    {
+        for (int i = 0; i < depth; i++)
+        {
+            x [i] = new float [dimensions [i + 1]]();
+            activations [i] = new float [dimensions [i + 1]]();
+            derivatives [i] = new float [dimensions [i + 1]]();
+        };
+
+        output = new float [dimensions [depth]]();
+
+        __partition (new float [ParameterCount (dimensions)](), dimensions);
+        __allocate_errors (dimensions);
+    };
+
+    // Borrows the layers' buffers, output and gradients (laid out as above); only the error rows are allocated
+    Workspace (Layer <depth>* const layers [depth], float* output, float* gradients, const size_t dimensions [depth + 1]) 
+        : output {output}, owner {false}
+    {
+        for (int i = 0; i < depth; i++)
+        {
+            x [i] = layers [i] -> x;
+            activations [i] = layers [i] -> activations;
+            derivatives [i] = layers [i] -> derivatives;
+        };
+
+        __partition (gradients, dimensions);
+        __allocate_errors (dimensions);
+    };
+
+    ~Workspace ()
+    {
+        delete [] errors [0];
+        delete [] errors [1];
+
+        if (!owner) return;
+
+        for (int i = 0; i < depth; i++)
+        {
+            delete [] x [i];
+            delete [] activations [i];
+            delete [] derivatives [i];
+        };
+
+        delete [] output;
+        delete [] gradients;
+    };
+
+    Workspace (const Workspace&) = delete;
+
+    static size_t ParameterCount (const size_t dimensions [depth + 1])
+    {
+        size_t count = 0;
+
+        for (int i = 0; i < depth; i++)
+        {
+            count += dimensions [i + 1] * (dimensions [i] + 1);
+        };
+
+        return count;
+    };
+
+    void __partition (float* block, const size_t dimensions [depth + 1])
+    {
+        gradients = block;
+        parameter_count = ParameterCount (dimensions);
+
+        for (int i = 0; i < depth; i++)
+        {
+            weight_gradients [i] = block;
+            bias_gradients [i] = block + dimensions [i + 1] * dimensions [i];
+            block += dimensions [i + 1] * (dimensions [i] + 1);
         };
     };
+
+    void __allocate_errors (const size_t dimensions [depth + 1])
+    {
+        const size_t width = *std::max_element (dimensions, dimensions + depth + 1);
+
+        errors [0] = new float [width]();
+        errors [1] = new float [width]();
+    };
 };
 
 template <size_t depth>
@@ -1073,19 +3982,30 @@ struct Network
     const float learning_rate_time_constant;
     float momentum;
     const float decay_rate;
+    float adam_decay_rate = 0.999; // beta2 of Adam and AdamW; decay_rate is RMSProp's, far too fast for Adam
     const int epochs;
 
     NormalisedRandom <depth>* r;
     const int seed; // TODO: use global seed
 
+    float* gradients; // one block, laid out as in Workspace
+    size_t parameter_count;
     float** weight_gradients [depth];
     float* bias_gradients [depth];
 
-    float** weight_velocities [depth];
-    float* bias_velocities [depth];
+    // Weights and biases of every layer as flat spans, paired with their gradients
+    ParameterSpan spans [2 * depth];
+    Optimiser* optimiser = nullptr;
+
+    double squared_weights;
 
-    float** weight_RMSP [depth];
-    float* bias_RMSP [depth];
+    // Forward and backward buffers of the serial training path
+    Workspace <depth>* workspace;
+
+    // Data-parallel training, see UseThreads
+    ThreadPool* pool = nullptr;
+    Workspace <depth>** shards = nullptr;
+    size_t shard_count = 0;
 
 
     // Constructor
@@ -1093,8 +4013,7 @@ struct Network
     (
         size_t dimensions [depth + 1], 
 
-        activation_fn functions [depth], 
-        activation_fn derivatives [depth], 
+        ActivationType functions [depth], 
 
         output_fn OutputFunction = Identity, 
 
@@ -1129,104 +4048,153 @@ struct Network
         output = new float [dimensions [depth]];
         r = new NormalisedRandom <depth> (dimensions, 1000);
 
+        // All gradients in one block, so the optimiser can treat each layer as flat spans and data-parallel
+        // training can reduce them in one pass
+        parameter_count = Workspace <depth>::ParameterCount (dimensions);
+        gradients = new float [parameter_count]();
+
+        float* block = gradients;
+
         for (int i = 0; i < depth; i++) 
         {
             size_t M = dimensions [i + 1];
             size_t N = dimensions [i];
 
-            activation_fn f = functions [i];
-            activation_fn f_prime = derivatives [i];
-
             // Initialise gradients
             float** w = new float* [M];
-            for (int j = 0; j < M; j++)
+            w [0] = block;
+            for (int j = 1; j < M; j++)
             {
-                w [j] = new float [N];
+                w [j] = w [j - 1] + N;
             };
 
-            float* b = new float [M];
+            float* b = block + M * N;
+            block += M * (N + 1);
 
             weight_gradients [i] = w;
             bias_gradients [i] = b;
 
-            // Initialise velocities
-            float** wv = new float* [M];
-            for (int j = 0; j < M; j++)
-            {
-                wv [j] = new float [N]();
-            };
+            // Create layer
+            layers [i] = new Layer <depth> (nullptr, nullptr, M, N, functions [i], r, i);
+
+            // Optimiser state is allocated by the optimiser itself, on its first step
+            spans [2 * i]     = { layers [i] -> weights [0], w [0], M * N, true };
+            spans [2 * i + 1] = { layers [i] -> biases,      b,     M,     false };
+        };
+
+        workspace = new Workspace <depth> (layers, output, gradients, dimensions);
 
-            float* bv = new float [M]();
+        ResetRegulariser ();
+    };
+
+    ~Network ()
+    {
+        delete workspace;
+        FreeShards ();
+
+        delete [] output;
+        delete [] gradients;
+        delete r;
+        delete optimiser;
+
+        for (int i = 0; i < depth; i++)
+        {
+            delete [] weight_gradients [i];
+
+            delete layers [i];
+        };
+    };
 
-            weight_velocities [i] = wv;
-            bias_velocities [i] = bv;
+    float* Propagate (float input []) 
+    {
+        return Forward (input, *workspace);
+    };
 
-            // Initialise RMSProp accumulation variables
-            float** wrmsp = new float* [M];
-            for (int j = 0; j < M; j++)
+    // Forward pass writing only to w, so it can run concurrently for different workspaces
+    float* Forward (const float input [], Workspace <depth>& w) const
+    {
+        for (int i = 0; i < depth; i++) 
+        {
+            if (w.shared)
+            {
+                layers [i] -> template Forward <true> (input, w.x [i], w.activations [i], w.derivatives [i]);
+            }
+            else
             {
-                wrmsp [j] = new float [N]();
+                layers [i] -> Forward (input, w.x [i], w.activations [i], w.derivatives [i]);
             };
 
-            float* brmsp = new float [M]();
+            input = w.activations [i];
+        };
 
-            weight_RMSP [i] = wrmsp;
-            bias_RMSP [i] = brmsp;
+        size_t M = dimensions [depth];
+        float* x = OutputFunction (w.activations [depth - 1], M);
 
-            // Create layer
-            layers [i] = new Layer <depth> (nullptr, nullptr, M, N, f, f_prime, r, i);
+        for (int i = 0; i < M; i++)
+        {
+            w.output [i] = x [i];
         };
+
+        return w.output;
     };
 
-    ~Network ()
+    size_t MaxWidth () const
     {
-        delete [] output;
-        delete r;
+        size_t width = 0;
 
-        for (int i = 0; i < depth; i++)
+        for (int i = 0; i <= depth; i++)
         {
-            size_t M = dimensions [i + 1];
+            width = std::max (width, dimensions [i]);
+        };
 
-            for (int j = 0; j < M; j++)
-            {
-                delete [] weight_gradients [i][j];
-                delete [] weight_velocities [i][j];
-                delete [] weight_RMSP [i][j];
-            };
+        return width;
+    };
 
-            delete [] weight_gradients [i];
-            delete [] bias_gradients [i];
+    // Thread-safe inference: reads the weights only, and keeps intermediate activations in scratch.
+    // inputs and outputs hold batch rows of dimensions [0] and dimensions [depth] floats respectively
+    void Infer (const float* const inputs [], float* outputs [], size_t batch, InferenceScratch& scratch) const
+    {
+        scratch.Reserve (MaxWidth (), batch);
 
-            delete [] weight_velocities [i];
-            delete [] bias_velocities [i];
+        const size_t N = dimensions [0];
+        const size_t M = dimensions [depth];
 
-            delete [] weight_RMSP [i];
-            delete [] bias_RMSP [i];
+        float* in  = scratch.buffers [0];
+        float* out = scratch.buffers [1];
 
-            delete layers [i];
+        for (size_t b = 0; b < batch; b++)
+        {
+            std::copy (inputs [b], inputs [b] + N, in + b * N);
         };
-    };
 
-    float* Propagate (float input []) 
-    {
         for (int i = 0; i < depth; i++) 
         {
-            Layer <depth>* l = layers [i];
-            l -> SetActivations (input);
-
-            input = l -> activations;
+            layers [i] -> Apply (in, out, batch);
+            std::swap (in, out);
         };
 
-        Layer <depth>* l = layers [depth - 1];
-        size_t M = l -> size.M;
-        float* x = OutputFunction (l -> activations, M);
-
-        for (int i = 0; i < M; i++)
+        for (size_t b = 0; b < batch; b++)
         {
-            output [i] = x [i];
+            float* y = OutputFunction (in + b * M, M);
+            std::copy (y, y + M, outputs [b]);
         };
+    };
+
+    void Infer (const float input [], float output [], InferenceScratch& scratch) const
+    {
+        Infer (&input, &output, 1, scratch);
+    };
+
+    // As above, with scratch private to the calling thread
+    void Infer (const float* const inputs [], float* outputs [], size_t batch = 1) const
+    {
+        static thread_local InferenceScratch scratch;
+        Infer (inputs, outputs, batch, scratch);
+    };
 
-        return output;
+    void Infer (const float input [], float output []) const
+    {
+        Infer (&input, &output, 1);
     };
 
     #if DEBUG_LEVEL == 1
@@ -1326,17 +4294,23 @@ struct Network
     };
     #endif
 
+    // Sum of squared weights, tracked incrementally by the Update* methods
     float Regulariser () 
+    {
+        return squared_weights;
+    };
+
+    // Recomputes the tracked sum of squared weights from scratch, discarding accumulated rounding drift
+    void ResetRegulariser () 
     {
         // float bias_sum = 0.0;
-        float weight_sum = 0.0;
+        double weight_sum = 0.0;
 
         for (int i = 0; i < depth; i++)
         {
             Layer <depth>* layer = layers [i];
             float** w = layer -> weights;
             // float* b = layer -> biases;
-            
 
             size_t M = layer -> size.M;
             size_t N = layer -> size.N;
@@ -1347,33 +4321,13 @@ struct Network
 
                 for (int k = 0; k < N; k++)
                 {
-                    weight_sum += pow (w [j][k], 2);
+                    weight_sum += w [j][k] * w [j][k];
                 };
             };
         };
 
-        // return weight_sum + bias_sum;
-        return weight_sum;
-    };
-
-    void SetRegulariserGradients (Layer <depth>* layer, float* b, float** w) 
-    {
-        size_t M = layer -> size.M;
-        size_t N = layer -> size.N;
-
-        // float* biases = layer -> biases;
-        float** weights = layer -> weights;
-
-        for (int i = 0; i < M; i++)
-        {
-            // b [i] = 2 * biases [i];
-            b [i] = 0;
-
-            for (int j = 0; j < N; j++)
-            {
-                w [i][j] = 2 * weights [i][j];
-            };
-        };
+        // squared_weights = weight_sum + bias_sum;
+        squared_weights = weight_sum;
     };
 
     float Cost (float input [], float expected []) 
@@ -1385,17 +4339,45 @@ struct Network
         return loss + regularisation_factor * Regulariser ();
     };
 
+    // Switches every layer's activations to the vmath.h approximations (for the loss, pass FastCrossEntropy)
+    void UseFastMath (bool enable = true)
+    {
+        for (int i = 0; i < depth; i++)
+        {
+            layers [i] -> fast_math = enable;
+        };
+    };
+
     void UpdateLearningRate (int i)
+    {
+        learning_rate = LearningRate (i);
+    };
+
+    // Learning rate of step i of the decay schedule
+    float LearningRate (int i) const
     {
         float alpha = (float)i / (float)learning_rate_time_constant;
         alpha = std::min (alpha, (float)1.0);
-        learning_rate = (1 - 0.99 * alpha) * base_learning_rate;
+        return (1 - 0.99 * alpha) * base_learning_rate;
+    };
+
+    // Keeps the current optimiser (and its state) if it is already of the requested type, otherwise replaces it
+    template <typename OptimiserType, typename... Args>
+    void SelectOptimiser (Args... args)
+    {
+        if (optimiser == nullptr || typeid (*optimiser) != typeid (OptimiserType))
+        {
+            delete optimiser;
+            optimiser = new OptimiserType (args...);
+        };
     };
 
     float* GD_Basic (float* input_set [], float* expected_set [], size_t set_size, int seed = 1000) //TODO: use global seed
     { 
         float* costs = new float [set_size * epochs];
 
+        SelectOptimiser <GradientDescent> ();
+
         int indices [set_size];
         for (int i = 0; i < set_size; i++)
         {
@@ -1405,6 +4387,7 @@ struct Network
         for (int i = 0; i < epochs; i++)
         {
             shuffle (indices, indices + set_size, std::mt19937 (seed));
+            ResetRegulariser ();
 
             for (int j = 0; j < set_size; j++)
             {
@@ -1412,19 +4395,19 @@ struct Network
 
                 int a = indices [j];
 
-                costs [i * set_size + j] = Cost (input_set [a], expected_set [a]);
+                costs [i * set_size + j] = BackPropagate (input_set [a], expected_set [a]) + regularisation_factor * Regulariser ();
 
-                BackPropagate (input_set [a], expected_set [a]);
-                UpdateGradientDescent ();
+                UpdateParameters ();
             };
         };
         return costs;
     };
 
-    float* GD_Stochastic (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
+    // Minibatch training with whichever optimiser is selected; nesterov evaluates gradients at the look-ahead point
+    float* GD_Minibatch (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size, bool nesterov = false)
     { 
-        float* costs = new float [set_size];
         int k = set_size / minibatch_size;
+        float* costs = new float [k * epochs];
         float mean_batch = (float)1 / (float)minibatch_size;
 
         int indices [set_size];
@@ -1436,33 +4419,103 @@ struct Network
         for (int i = 0; i < epochs; i++)
         {
             shuffle (indices, indices + set_size, std::mt19937 (seed));
+            ResetRegulariser ();
 
             for (int j = 0; j < k; j++)
             {
                 UpdateLearningRate (j);
 
-                costs [i * k + j] = Cost (input_set [indices [j * minibatch_size]], expected_set [indices [j * minibatch_size]]);
+                if (nesterov)
+                {
+                    UpdateInterim ();
+                };
 
-                ResetGradients ();
+                float batch_loss = 0.0;
 
-                for (int k = 0; k < minibatch_size; k++)
+                if (pool != nullptr)
                 {
-                    BackPropagateStochastic (input_set [indices [j * minibatch_size + k]], expected_set [indices [j * minibatch_size + k]], mean_batch);
+                    batch_loss = BackPropagateParallel (input_set, expected_set, indices + j * minibatch_size, minibatch_size);
+                }
+                else
+                {
+                    ResetGradients ();
+
+                    for (int k = 0; k < minibatch_size; k++)
+                    {
+                        batch_loss += mean_batch * BackPropagateStochastic (input_set [indices [j * minibatch_size + k]], expected_set [indices [j * minibatch_size + k]], mean_batch);
+                    };
                 };
 
-                UpdateGradientDescent ();
+                costs [i * k + j] = batch_loss + regularisation_factor * Regulariser ();
+
+                UpdateParameters ();
             };
         };
         return costs;
     };
 
+    float* GD_Stochastic (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
+    { 
+        SelectOptimiser <GradientDescent> ();
+        return GD_Minibatch (input_set, expected_set, set_size, minibatch_size);
+    };
+
     float* GD_StochasticMomentum (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
     { 
-        float* costs = new float [set_size];
-        int k = set_size / minibatch_size;
-        float mean_batch = (float)1 / (float)minibatch_size;
+        SelectOptimiser <Momentum> (momentum);
+        return GD_Minibatch (input_set, expected_set, set_size, minibatch_size);
+    };
 
-        int indices [set_size];
+    float* GD_StochasticNesterov (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
+    { 
+        SelectOptimiser <Momentum> (momentum);
+        return GD_Minibatch (input_set, expected_set, set_size, minibatch_size, true);
+    };
+
+    float* GD_RMSProp (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
+    { 
+        SelectOptimiser <RMSProp> (decay_rate);
+        return GD_Minibatch (input_set, expected_set, set_size, minibatch_size);
+    };
+
+    float* GD_RMSPropNesterov (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
+    { 
+        SelectOptimiser <NesterovRMSProp> (momentum, decay_rate);
+        return GD_Minibatch (input_set, expected_set, set_size, minibatch_size, true);
+    };
+
+    // Adam and AdamW take momentum and adam_decay_rate as beta1 and beta2
+    float* GD_Adam (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
+    { 
+        SelectOptimiser <Adam> (momentum, adam_decay_rate);
+        return GD_Minibatch (input_set, expected_set, set_size, minibatch_size);
+    };
+
+    float* GD_AdamW (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
+    { 
+        SelectOptimiser <AdamW> (momentum, adam_decay_rate);
+        return GD_Minibatch (input_set, expected_set, set_size, minibatch_size);
+    };
+
+    // Lock-free asynchronous SGD (Hogwild): every thread of the pool set by UseThreads (or just the calling thread)
+    // takes examples from the shuffled index list and applies its own per-example update straight to the shared
+    // parameters. The passes read the parameters with relaxed atomic loads, so they never race with the updates but
+    // may see some of them half applied, and updates may overwrite each other.
+    // That costs little accuracy when gradients rarely collide and saves all synchronisation. Results depend on
+    // thread scheduling. Returns the cost of every example in shuffled order; the regulariser term is the epoch start's
+    float* GD_Hogwild (float* input_set [], float* expected_set [], size_t set_size)
+    {
+        float* costs = new float [set_size * epochs];
+        const size_t threads = (pool == nullptr) ? 1 : pool -> size;
+
+        Workspace <depth>** workspaces = new Workspace <depth>* [threads];
+        for (size_t t = 0; t < threads; t++)
+        {
+            workspaces [t] = new Workspace <depth> (dimensions);
+            workspaces [t] -> shared = true;
+        };
+
+        int* indices = new int [set_size];
         for (int i = 0; i < set_size; i++)
         {
             indices [i] = i;
@@ -1471,480 +4524,783 @@ struct Network
         for (int i = 0; i < epochs; i++)
         {
             shuffle (indices, indices + set_size, std::mt19937 (seed));
+            ResetRegulariser ();
 
-            for (int j = 0; j < k; j++)
+            const float regulariser = regularisation_factor * Regulariser ();
+            std::atomic <size_t> next {0};
+
+            auto worker = [&] (size_t t)
             {
-                UpdateLearningRate (j);
+                Workspace <depth>& w = *workspaces [t];
 
-                costs [i * k + j] = Cost (input_set [indices [j * minibatch_size]], expected_set [indices [j * minibatch_size]]);
+                for (size_t j = next++; j < set_size; j = next++)
+                {
+                    const int a = indices [j];
 
-                ResetGradients ();
+                    Forward (input_set [a], w);
+                    costs [i * set_size + j] = Backward (input_set [a], expected_set [a], w, 1.0) + regulariser;
 
-                for (int k = 0; k < minibatch_size; k++)
-                {
-                    BackPropagateStochastic (input_set [indices [j * minibatch_size + k]], expected_set [indices [j * minibatch_size + k]], mean_batch);
+                    const float rate = LearningRate (j);
+
+                    for (int l = 0; l < depth; l++)
+                    {
+                        HogwildKernel (spans [2 * l].parameters,     w.weight_gradients [l], spans [2 * l].length,     rate, 2 * regularisation_factor);
+                        HogwildKernel (spans [2 * l + 1].parameters, w.bias_gradients [l],   spans [2 * l + 1].length, rate, 0.0);
+                    };
                 };
+            };
 
-                UpdateMomentum ();
+            if (pool == nullptr)
+            {
+                worker (0);
+            }
+            else
+            {
+                pool -> Run (threads, worker);
             };
         };
+
+        ResetRegulariser ();
+
+        for (size_t t = 0; t < threads; t++)
+        {
+            delete workspaces [t];
+        };
+
+        delete [] workspaces;
+        delete [] indices;
+
         return costs;
     };
 
-    float* GD_StochasticNesterov (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
-    { 
-        float* costs = new float [set_size];
-        int k = set_size / minibatch_size;
-        float mean_batch = (float)1 / (float)minibatch_size;
+    void ResetGradients ()
+    {
+        std::fill (gradients, gradients + parameter_count, 0.0f);
+    };
 
-        int indices [set_size];
-        for (int i = 0; i < set_size; i++)
+    // Returns the loss of the forward pass used to compute the gradients
+    float BackPropagate (float input [], float expected []) 
+    {
+        ResetGradients ();
+
+        return BackPropagateStochastic (input, expected, 1.0);
+    };
+
+    // Accumulates mean_batch * gradients and returns the (unscaled, unregularised) loss of the forward pass
+    float BackPropagateStochastic (float input [], float expected [], float mean_batch = 0.0) 
+    {
+        Propagate (input);
+
+        return Backward (input, expected, *workspace, mean_batch);
+    };
+
+    // Backward pass through the buffers of the last Forward into w, accumulating mean_batch * gradients into
+    // w.gradients and returning the loss. Like Forward, writes only to w. If given, layer_done (i) is called as soon
+    // as layer i's gradients are complete, before the layers below it are processed
+    float Backward 
+    (
+        float input [], float expected [], Workspace <depth>& w, float mean_batch, 
+        const std::function <void (int)>& layer_done = nullptr
+    ) const
+    {
+        float* y = w.output;
+        size_t n = dimensions [depth];
+        float* g = w.errors [0];
+        LossGradient (y, expected, g, n);
+
+        const float loss = LossFunction (y, expected, n);
+
+        // Iterate through layers and calculate gradient
+        for (int i = depth - 1; i > -1; i--) 
         {
-            indices [i] = i;
+            // Activations of the previous layer, and where the gradient with respect to them goes
+            const float* a = (i > 0) ? w.activations [i - 1] : input;
+            float* previous = (i > 0) ? ((g == w.errors [0]) ? w.errors [1] : w.errors [0]) : nullptr;
+
+            if (w.shared)
+            {
+                layers [i] -> template Backward <true> (a, w.derivatives [i], g, w.weight_gradients [i], w.bias_gradients [i], previous, mean_batch);
+            }
+            else
+            {
+                layers [i] -> Backward (a, w.derivatives [i], g, w.weight_gradients [i], w.bias_gradients [i], previous, mean_batch);
+            };
+
+            if (layer_done) layer_done (i);
+
+            g = previous;
         };
 
-        for (int i = 0; i < epochs; i++)
+        return loss;
+    };
+
+    // Shards every minibatch of GD_Minibatch across the threads of pool, or trains serially again if pool is nullptr.
+    // Each of the shard_count shards takes a contiguous slice of the minibatch into a private workspace, and the shard
+    // gradients are summed by a fixed pairwise tree, so results depend on shard_count but not on the thread count.
+    // shard_count bounds the useful number of threads
+    void UseThreads (ThreadPool* pool, size_t shard_count = 16)
+    {
+        FreeShards ();
+
+        this -> pool = pool;
+
+        if (pool == nullptr) return;
+
+        this -> shard_count = shard_count;
+        shards = new Workspace <depth>* [shard_count];
+
+        for (size_t s = 0; s < shard_count; s++)
         {
-            shuffle (indices, indices + set_size, std::mt19937 (seed));
+            shards [s] = new Workspace <depth> (dimensions);
+        };
+    };
 
-            for (int j = 0; j < k; j++)
+    void FreeShards ()
+    {
+        for (size_t s = 0; s < shard_count; s++)
+        {
+            delete shards [s];
+        };
+
+        delete [] shards;
+        shards = nullptr;
+        shard_count = 0;
+    };
+
+    // Data-parallel equivalent of ResetGradients followed by BackPropagateStochastic over the minibatch given by
+    // batch_indices; returns the mean loss
+    float BackPropagateParallel (float* input_set [], float* expected_set [], const int batch_indices [], size_t batch_size)
+    {
+        const float mean_batch = (float)1 / (float)batch_size;
+
+        pool -> Run (shard_count, [&] (size_t s)
+        {
+            Workspace <depth>& w = *shards [s];
+            std::fill (w.gradients, w.gradients + parameter_count, 0.0f);
+
+            float loss = 0.0;
+
+            for (size_t b = s * batch_size / shard_count; b < (s + 1) * batch_size / shard_count; b++)
             {
-                UpdateLearningRate (j);
+                const int a = batch_indices [b];
 
-                costs [i * k + j] = Cost (input_set [indices [j * minibatch_size]], expected_set [indices [j * minibatch_size]]);
+                Forward (input_set [a], w);
+                loss += mean_batch * Backward (input_set [a], expected_set [a], w, mean_batch);
+            };
+
+            w.loss = loss;
+        });
 
-                UpdateInterim ();
-                ResetGradients ();
+        // Pairwise tree over the shards, one block of parameters per task
+        pool -> Run ((parameter_count + ReductionBlock - 1) / ReductionBlock, [&] (size_t block)
+        {
+            const size_t begin = block * ReductionBlock;
+            const size_t end = std::min (begin + ReductionBlock, parameter_count);
 
-                for (int k = 0; k < minibatch_size; k++)
+            for (size_t stride = 1; stride < shard_count; stride *= 2)
+            {
+                for (size_t s = 0; s + stride < shard_count; s += 2 * stride)
                 {
-                    BackPropagateStochastic (input_set [indices [j * minibatch_size + k]], expected_set [indices [j * minibatch_size + k]], mean_batch);
-                };
+                    float* __restrict sum = shards [s] -> gradients;
+                    const float* __restrict other = shards [s + stride] -> gradients;
 
-                UpdateMomentum ();
+                    #pragma omp simd
+                    for (size_t i = begin; i < end; i++)
+                    {
+                        sum [i] += other [i];
+                    };
+                };
             };
+
+            std::copy (shards [0] -> gradients + begin, shards [0] -> gradients + end, gradients + begin);
+        });
+
+        float batch_loss = 0.0;
+
+        for (size_t s = 0; s < shard_count; s++)
+        {
+            batch_loss += shards [s] -> loss;
         };
-        return costs;
+
+        return batch_loss;
     };
 
-    float* GD_RMSProp (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
+
+    void UpdateParameters () 
     { 
-        float* costs = new float [set_size];
-        int k = set_size / minibatch_size;
-        float mean_batch = (float)1 / (float)minibatch_size;
+        squared_weights += optimiser -> Step (spans, 2 * depth, learning_rate, 2 * regularisation_factor);
+    };   
 
-        int indices [set_size];
-        for (int i = 0; i < set_size; i++)
+    void UpdateInterim () 
+    { 
+        squared_weights += optimiser -> Lookahead (spans, 2 * depth);
+    };   
+};
+
+
+// ***---------  PIPELINE  ---------*** //
+
+// Pipeline-parallel training: the layers of a Network are split into contiguous stages of roughly equal weight count,
+// each run by its own thread, and every minibatch is streamed through them in micro-batches (GPipe). A stage runs the
+// forward pass of each micro-batch as soon as the previous stage hands it over, then the backward passes in the same
+// order as the next stage returns them, then steps its own optimiser over its own layers. Stages hand over micro-batch
+// indices through lock-free SPSC queues, and the activations and errors themselves stay in the sending stage's buffers.
+// Gradients accumulate sample by sample in the same order as GD_Minibatch, so the weights match serial training.
+template <size_t depth>
+struct Pipeline
+{
+    static constexpr size_t QueueCapacity = 64;
+
+    struct Stage
+    {
+        size_t begin, end; // layers [begin, end)
+
+        float* activations [depth]; // one row per sample of the minibatch, for the layers of this stage
+        float* derivatives [depth];
+        float* x;                   // nets of the current sample, discarded
+        float* errors;              // gradient with respect to this stage's input, one row per sample
+        float* rows [2];            // back-propagated error within the stage
+
+        SPSCQueue <size_t, QueueCapacity> forward;  // micro-batches whose input is ready
+        SPSCQueue <size_t, QueueCapacity> backward; // micro-batches whose output error is ready
+
+        Optimiser* optimiser = nullptr;
+    };
+
+    Network <depth>& network;
+    const size_t stage_count;
+    const size_t micro_batch_size;
+
+    Stage* stages;
+    size_t capacity = 0; // minibatch size the stage buffers are allocated for
+
+    Pipeline (Network <depth>& network, size_t stage_count, size_t micro_batch_size)
+        : network {network}, stage_count {std::min (std::max (stage_count, (size_t)1), depth)}, micro_batch_size {micro_batch_size}
+    {
+        stages = new Stage [this -> stage_count];
+
+        // A layer joins the stage its weight count's midpoint falls in, keeping at least one layer per stage
+        auto weights = [&] (size_t i) { return (double)(network.dimensions [i] * network.dimensions [i + 1]); };
+
+        double total = 0.0;
+        for (int i = 0; i < depth; i++)
         {
-            indices [i] = i;
+            total += weights (i);
         };
 
-        for (int i = 0; i < epochs; i++)
+        size_t layer = 0;
+        double running = 0.0;
+
+        for (size_t s = 0; s < this -> stage_count; s++)
         {
-            shuffle (indices, indices + set_size, std::mt19937 (seed));
+            stages [s].begin = layer;
 
-            for (int j = 0; j < k; j++)
+            const size_t remaining = this -> stage_count - s - 1;
+            const double target = total * (s + 1) / this -> stage_count;
+
+            do
             {
-                UpdateLearningRate (j);
+                running += weights (layer);
+                layer++;
+            }
+            while (layer < depth - remaining && running + weights (layer) / 2 < target);
+
+            stages [s].end = layer;
+        };
+
+        stages [this -> stage_count - 1].end = depth;
+    };
+
+    ~Pipeline ()
+    {
+        Free ();
+        delete [] stages;
+    };
+
+    Pipeline (const Pipeline&) = delete;
+
+    void Reserve (size_t minibatch_size)
+    {
+        if (minibatch_size <= capacity) return;
+
+        Free ();
+        capacity = minibatch_size;
+
+        const size_t width = network.MaxWidth ();
+
+        for (size_t s = 0; s < stage_count; s++)
+        {
+            Stage& stage = stages [s];
+
+            for (size_t i = stage.begin; i < stage.end; i++)
+            {
+                stage.activations [i] = new float [capacity * network.dimensions [i + 1]];
+                stage.derivatives [i] = new float [capacity * network.dimensions [i + 1]];
+            };
 
-                costs [i * k + j] = Cost (input_set [indices [j * minibatch_size]], expected_set [indices [j * minibatch_size]]);
+            stage.x = new float [width];
+            stage.errors = new float [capacity * network.dimensions [stage.begin]];
+            stage.rows [0] = new float [width];
+            stage.rows [1] = new float [width];
+        };
+    };
 
-                ResetGradients ();
+    void Free ()
+    {
+        if (capacity == 0) return;
 
-                for (int k = 0; k < minibatch_size; k++)
-                {
-                    BackPropagateStochastic (input_set [indices [j * minibatch_size + k]], expected_set [indices [j * minibatch_size + k]], mean_batch);
-                };
+        for (size_t s = 0; s < stage_count; s++)
+        {
+            Stage& stage = stages [s];
 
-                UpdateRMSProp ();
+            for (size_t i = stage.begin; i < stage.end; i++)
+            {
+                delete [] stage.activations [i];
+                delete [] stage.derivatives [i];
             };
+
+            delete [] stage.x;
+            delete [] stage.errors;
+            delete [] stage.rows [0];
+            delete [] stage.rows [1];
         };
-        return costs;
+
+        capacity = 0;
     };
 
-    float* GD_RMSPropNesterov (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size)
-    { 
-        float* costs = new float [set_size];
-        int k = set_size / minibatch_size;
-        float mean_batch = (float)1 / (float)minibatch_size;
+    // Trains like GD_Minibatch with a fresh OptimiserType (args...) per stage. Costs are the minibatch losses plus
+    // the regulariser as it stood at the start of each epoch
+    template <typename OptimiserType, typename... Args>
+    float* Train (float* input_set [], float* expected_set [], size_t set_size, size_t minibatch_size, Args... args)
+    {
+        Reserve (minibatch_size);
 
-        int indices [set_size];
+        const int k = set_size / minibatch_size;
+        float* costs = new float [k * network.epochs];
+
+        int* indices = new int [set_size];
         for (int i = 0; i < set_size; i++)
         {
             indices [i] = i;
         };
 
-        for (int i = 0; i < epochs; i++)
+        for (size_t s = 0; s < stage_count; s++)
         {
-            shuffle (indices, indices + set_size, std::mt19937 (seed));
-
-            for (int j = 0; j < k; j++)
-            {
-                UpdateLearningRate (j);
+            stages [s].optimiser = new OptimiserType (args...);
+        };
 
-                costs [i * k + j] = Cost (input_set [indices [j * minibatch_size]], expected_set [indices [j * minibatch_size]]);
+        std::thread* threads = new std::thread [stage_count - 1];
 
-                UpdateInterim ();
-                ResetGradients ();
+        for (int i = 0; i < network.epochs; i++)
+        {
+            shuffle (indices, indices + set_size, std::mt19937 (network.seed));
+            network.ResetRegulariser ();
 
-                for (int k = 0; k < minibatch_size; k++)
-                {
-                    BackPropagateStochastic (input_set [indices [j * minibatch_size + k]], expected_set [indices [j * minibatch_size + k]], mean_batch);
-                };
+            const float regulariser = network.regularisation_factor * network.Regulariser ();
 
-                UpdateNesterovRMSProp ();
+            for (size_t s = 1; s < stage_count; s++)
+            {
+                threads [s - 1] = std::thread ([&, s] () { __run (s, input_set, expected_set, indices, k, minibatch_size, costs + i * k, regulariser); });
             };
-        };
-        return costs;
-    };
 
-    void ResetGradients ()
-    {
-        for (int i = 0; i < depth; i++)
-        {
-            size_t M = dimensions [i + 1];
-            size_t N = dimensions [i];
+            __run (0, input_set, expected_set, indices, k, minibatch_size, costs + i * k, regulariser);
 
-            for (int j = 0; j < M; j++)
+            for (size_t s = 1; s < stage_count; s++)
             {
-                bias_gradients [i][j] = 0.0;
-
-                for (int k = 0; k < N; k++)
-                {
-                    weight_gradients [i][j][k] = 0.0;
-                };
+                threads [s - 1].join ();
             };
         };
-    };
 
-    void BackPropagate (float input [], float expected []) 
-    {
-        float* y = Propagate (input);
-        size_t n = dimensions [depth];
-        float* g = LossGradient (y, expected, n);
+        network.ResetRegulariser ();
 
-        // Iterate through layers and calculate gradient
-        for (int i = depth - 1; i > -1; i--) 
+        for (size_t s = 0; s < stage_count; s++)
         {
-            Layer <depth>* layer = layers [i];
+            delete stages [s].optimiser;
+            stages [s].optimiser = nullptr;
+        };
 
-            size_t M = layer -> size.M;
-            size_t N = layer -> size.N;
+        delete [] threads;
+        delete [] indices;
 
-            activation_fn fn_prime = layer -> fn_prime;
+        return costs;
+    };
 
-            // Gradient of loss function with respect to the nets of layer i
-            for (int j = 0; j < M; j++) 
-            {
-                g [j] *= fn_prime (layer -> x [j]);
-            };
+    // One stage's share of an epoch. Only the last stage knows the losses, so it writes the costs
+    void __run (size_t s, float* input_set [], float* expected_set [], const int indices [], int k, size_t minibatch_size, float* costs, float regulariser)
+    {
+        Stage& stage = stages [s];
+        const bool last = (s == stage_count - 1);
 
-            // Prepare some memory
-            float b [M];
-            float w [M][N];
+        const size_t micro_batches = (minibatch_size + micro_batch_size - 1) / micro_batch_size;
+        const float mean_batch = (float)1 / (float)minibatch_size;
 
-            float rgb [M];
-            float** rgw = new float* [M];
-            for (int j = 0; j < M; j++)
-            {
-                rgw [j] = new float [N];
-            };
+        const size_t N = network.dimensions [stage.begin];
+        const size_t O = network.dimensions [depth];
 
-            // Calculate gradients from regulariser
-            SetRegulariserGradients (layer, rgb, rgw);
+        for (int j = 0; j < k; j++)
+        {
+            const int* batch = indices + j * minibatch_size;
 
-            // Fetch activations of preivous layer
-            float* a;
-            if (i > 0) 
+            for (size_t i = stage.begin; i < stage.end; i++)
             {
-                a = layers [i - 1] -> activations;
-            }
-            else 
-            {
-                a = input;
+                std::fill (network.weight_gradients [i][0], network.bias_gradients [i] + network.dimensions [i + 1], 0.0f);
             };
 
-            // Calculate gradient of loss function with respect to the weights and biases of layer i
-            for (int j = 0; j < M; j++)
+            // Forward, one micro-batch at a time as the previous stage hands it over
+            for (size_t m = 0; m < micro_batches; m++)
             {
-                b [j] = g [j] + regularisation_factor * rgb [j];
+                if (s > 0) stage.forward.Pop ();
 
-                for (int k = 0; k < N; k++)
+                for (size_t b = m * micro_batch_size; b < std::min ((m + 1) * micro_batch_size, minibatch_size); b++)
                 {
-                    w [j][k] = g [j] * a [k] + regularisation_factor * rgw [j][k];
-                };
-            };
+                    const float* input = __input (s, input_set, batch, b);
 
-            for (int j = 0; j < M; j++)
-            {
-                delete [] rgw [j];
-            };
-            delete [] rgw;
+                    for (size_t i = stage.begin; i < stage.end; i++)
+                    {
+                        const size_t M = network.dimensions [i + 1];
 
-            // Calculate gradient of loss function with respect to the activations of the previous layer (i - 1)
-            float* x = new float [N]();
-            for (int k = 0; k < N; k++)
-            {
-                for (int j = 0; j < M; j++)
-                {
-                    x [k] += g [j] * layer -> weights [j][k];
+                        network.layers [i] -> Forward (input, stage.x, stage.activations [i] + b * M, stage.derivatives [i] + b * M);
+                        input = stage.activations [i] + b * M;
+                    };
                 };
+
+                if (!last) stages [s + 1].forward.Push (m);
             };
 
-            delete [] g;
-            g = x;
+            // Backward, in the same order, so gradients accumulate in the order GD_Minibatch uses
+            float batch_loss = 0.0;
 
-            // Store the gradients
-            for (int j = 0; j < M; j++)
+            for (size_t m = 0; m < micro_batches; m++)
             {
-                bias_gradients [i][j] = b [j];
+                if (!last) stage.backward.Pop ();
 
-                for (int k = 0; k < N; k++)
+                for (size_t b = m * micro_batch_size; b < std::min ((m + 1) * micro_batch_size, minibatch_size); b++)
                 {
-                    weight_gradients [i][j][k] = w [j][k];
+                    float* g = stage.rows [0];
+                    const size_t M = network.dimensions [stage.end];
+
+                    if (last)
+                    {
+                        // As Network::Forward, keep the output function's result apart from the activations
+                        float* output = stage.rows [1];
+                        float* y = network.OutputFunction (stage.activations [depth - 1] + b * O, O);
+                        std::copy (y, y + O, output);
+
+                        float* expected = expected_set [batch [b]];
+                        network.LossGradient (output, expected, g, O);
+                        batch_loss += mean_batch * network.LossFunction (output, expected, O);
+                    }
+                    else
+                    {
+                        const float* error = stages [s + 1].errors + b * M;
+                        std::copy (error, error + M, g);
+                    };
+
+                    for (size_t i = stage.end; i-- > stage.begin; )
+                    {
+                        const float* input = (i > stage.begin) ? stage.activations [i - 1] + b * network.dimensions [i] : __input (s, input_set, batch, b);
+
+                        // The first layer of a stage writes its input error for the previous stage
+                        float* previous = nullptr;
+                        if (i > stage.begin) previous = (g == stage.rows [0]) ? stage.rows [1] : stage.rows [0];
+                        else if (s > 0) previous = stage.errors + b * N;
+
+                        network.layers [i] -> Backward 
+                        (
+                            input, stage.derivatives [i] + b * network.dimensions [i + 1], g, 
+                            network.weight_gradients [i][0], network.bias_gradients [i], previous, mean_batch
+                        );
+
+                        g = previous;
+                    };
                 };
+
+                if (s > 0) stages [s - 1].backward.Push (m);
             };
+
+            // Each stage owns its layers' parameters, so it steps them without waiting for the others
+            stage.optimiser -> Step 
+            (
+                network.spans + 2 * stage.begin, 2 * (stage.end - stage.begin), 
+                network.LearningRate (j), 2 * network.regularisation_factor
+            );
+
+            if (last) costs [j] = batch_loss + regulariser;
         };
     };
 
-    void BackPropagateStochastic (float input [], float expected [], float mean_batch = 0.0) 
+    const float* __input (size_t s, float* input_set [], const int batch [], size_t b) const
     {
-        float* y = Propagate (input);
-        size_t n = dimensions [depth];
-        float* g = new float [n];
-        LossGradient (y, expected, g, n);
+        if (s == 0) return input_set [batch [b]];
 
-        // Iterate through layers and calculate gradient
-        for (int i = depth - 1; i > -1; i--) 
-        {
-            Layer <depth>* layer = layers [i];
+        const Stage& previous = stages [s - 1];
+        return previous.activations [previous.end - 1] + b * network.dimensions [previous.end];
+    };
+};
 
-            size_t M = layer -> size.M;
-            size_t N = layer -> size.N;
+// Weights of a Network repacked once for batch size 1 inference. Each layer's rows are grouped into blocks of
+// PackedBlock, and within a block the weights are interleaved by column, so one column of a block is a single
+// aligned vector load. The GEMV keeps a block's accumulators in registers over the whole input, starting from the
+// biases and applying the activation before the block is stored. All layers share one allocation, which for small
+// models stays resident in L1/L2.
+constexpr size_t PackedBlock = 16;
 
-            activation_fn fn_prime = layer -> fn_prime;
+template <size_t depth>
+struct PackedNetwork
+{
+    float* weights [depth]; // [blocks][N][PackedBlock]
+    float* biases [depth];  // [blocks * PackedBlock]
+    size_t rows [depth];    // M
+    size_t columns [depth]; // N
+    ActivationType activations [depth];
+    bool fast_math [depth];
 
-            // Gradient of loss function with respect to the nets of layer i
-            for (int j = 0; j < M; j++) 
-            {
-                g [j] *= fn_prime (layer -> x [j]);
-            };
+    float* memory;
+    size_t width; // widest layer, rounded up to a whole block
 
-            // Prepare some memory
-            float b [M];
-            float w [M][N];
+    output_fn OutputFunction;
 
-            float rgb [M];
-            float** rgw = new float* [M];
-            for (int j = 0; j < M; j++)
-            {
-                rgw [j] = new float [N];
-            };
+    PackedNetwork (const Network <depth>& network)
+        : OutputFunction {network.OutputFunction}
+    {
+        size_t length = 0;
+        width = 0;
 
-            // Calculate gradients from regulariser
-            SetRegulariserGradients (layer, rgb, rgw);
+        for (int i = 0; i < depth; i++)
+        {
+            const Layer <depth>* layer = network.layers [i];
+            const size_t padded = Padded (layer -> size.M);
 
-            // Fetch activations of preivous layer
-            float* a;
-            if (i > 0) 
-            {
-                a = layers [i - 1] -> activations;
-            }
-            else 
-            {
-                a = input;
-            };
+            rows [i] = layer -> size.M;
+            columns [i] = layer -> size.N;
+            activations [i] = layer -> activation;
+            fast_math [i] = layer -> fast_math;
 
-            // Calculate gradient of loss function with respect to the weights and biases of layer i
-            for (int j = 0; j < M; j++)
-            {
-                b [j] = g [j] + regularisation_factor * rgb [j];
+            length += padded * (columns [i] + 1);
+            width = std::max (width, std::max (padded, Padded (columns [i])));
+        };
 
-                for (int k = 0; k < N; k++)
-                {
-                    w [j][k] = g [j] * a [k] + regularisation_factor * rgw [j][k];
-                };
-            };
+        memory = new (std::align_val_t (64)) float [length]();
 
-            for (int j = 0; j < M; j++)
-            {
-                delete [] rgw [j];
-            };
-            delete [] rgw;
+        float* p = memory;
 
-            // Calculate gradient of loss function with respect to the activations of the previous layer (i - 1)
-            float* x = new float [N]();
-            for (int k = 0; k < N; k++)
-            {
-                for (int j = 0; j < M; j++)
-                {
-                    x [k] += g [j] * layer -> weights [j][k];
-                };
-            };
+        for (int i = 0; i < depth; i++)
+        {
+            const Layer <depth>* layer = network.layers [i];
+            const size_t M = rows [i];
+            const size_t N = columns [i];
 
-            delete [] g;
-            g = x;
+            weights [i] = p;
+            p += Padded (M) * N;
 
-            // Store the gradients
-            for (int j = 0; j < M; j++)
+            biases [i] = p;
+            p += Padded (M);
+
+            for (size_t j = 0; j < M; j++)
             {
-                bias_gradients [i][j] += mean_batch * b [j];
+                const size_t block = j / PackedBlock;
+                const size_t lane = j % PackedBlock;
 
-                for (int k = 0; k < N; k++)
+                for (size_t k = 0; k < N; k++)
                 {
-                    weight_gradients [i][j][k] += mean_batch * w [j][k];
+                    weights [i][(block * N + k) * PackedBlock + lane] = layer -> weights [j][k];
                 };
+
+                biases [i][j] = layer -> biases [j];
             };
         };
+    };
 
-        delete [] g;
+    ~PackedNetwork ()
+    {
+        ::operator delete [] (memory, std::align_val_t (64));
     };
 
+    PackedNetwork (const PackedNetwork&) = delete;
 
-    void UpdateGradientDescent () 
-    { 
-        for (int i = 0; i < depth; i++)
+    static size_t Padded (size_t n)
+    {
+        return ((n + PackedBlock - 1) / PackedBlock) * PackedBlock;
+    };
+
+    // output [0 .. padded M) = activation (W input + b) for one layer
+    static void __gemv (const float* __restrict w, const float* __restrict b, const float* __restrict input, float* __restrict output, size_t M, size_t N, ActivationType activation, bool fast_math)
+    {
+        for (size_t block = 0; block < Padded (M); block += PackedBlock)
         {
-            Layer <depth>* layer = layers [i];
-            
-            size_t M = layer -> size.M;
-            size_t N = layer -> size.N;
+            alignas (64) float accumulators [PackedBlock];
 
-            // Update parameters
-            for (int j = 0; j < M; j++)
+            #pragma omp simd
+            for (size_t lane = 0; lane < PackedBlock; lane++)
             {
-                layer -> biases [j] -= learning_rate * bias_gradients [i][j];
-
-                for (int k = 0; k < N; k++)
-                {
-                    layer -> weights [j][k] -= learning_rate * weight_gradients [i][j][k];
-                };
+                accumulators [lane] = b [block + lane];
             };
-        };
-    };   
 
-    void UpdateMomentum () 
-    { 
-        for (int i = 0; i < depth; i++)
-        {
-            Layer <depth>* layer = layers [i];
-            
-            size_t M = layer -> size.M;
-            size_t N = layer -> size.N;
+            const float* column = w + block * N;
 
-            // Update velocities
-            for (int j = 0; j < M; j++)
+            for (size_t k = 0; k < N; k++)
             {
-                bias_velocities [i][j] = momentum * bias_velocities [i][j] - learning_rate * bias_gradients [i][j];
+                const float x = input [k];
 
-                for (int k = 0; k < N; k++)
+                #pragma omp simd
+                for (size_t lane = 0; lane < PackedBlock; lane++)
                 {
-                    weight_velocities [i][j][k] = momentum * weight_velocities [i][j][k] - learning_rate * weight_gradients [i][j][k];
+                    accumulators [lane] += column [k * PackedBlock + lane] * x;
                 };
             };
 
-            // Update parameters
-            for (int j = 0; j < M; j++)
-            {
-                layer -> biases [j] += bias_velocities [i][j];
-
-                for (int k = 0; k < N; k++)
-                {
-                    layer -> weights [j][k] += weight_velocities [i][j][k];
-                };
-            };
+            Activate (activation, accumulators, output + block, PackedBlock, fast_math);
         };
-    }; 
+    };
+
+    // Thread-safe: scratch holds the intermediate activations
+    void Infer (const float input [], float output [], InferenceScratch& scratch) const
+    {
+        scratch.Reserve (width);
+
+        float* in  = scratch.buffers [0];
+        float* out = scratch.buffers [1];
+
+        std::copy (input, input + columns [0], in);
 
-    void UpdateInterim () 
-    { 
         for (int i = 0; i < depth; i++)
         {
-            Layer <depth>* layer = layers [i];
-            
-            size_t M = layer -> size.M;
-            size_t N = layer -> size.N;
+            __gemv (weights [i], biases [i], in, out, rows [i], columns [i], activations [i], fast_math [i]);
+            std::swap (in, out);
+        };
 
-            // Update parameters
-            for (int j = 0; j < M; j++)
-            {
-                layer -> biases [j] += momentum * bias_velocities [i][j];
+        const size_t M = rows [depth - 1];
+        float* y = OutputFunction (in, M);
+        std::copy (y, y + M, output);
+    };
 
-                for (int k = 0; k < N; k++)
-                {
-                    layer -> weights [j][k] += momentum * weight_velocities [i][j][k];
-                };
-            };
-        };
-    };   
+    void Infer (const float input [], float output []) const
+    {
+        static thread_local InferenceScratch scratch;
+        Infer (input, output, scratch);
+    };
+};
 
-    void UpdateRMSProp () 
+
+// ***---------  STATIC NETWORK  ---------*** //
+
+// A fully connected layer whose shape is known at compile time. Weights are stored transposed, [N][M], with M
+// padded to a whole number of PackedBlock lanes, so the product is a fixed sequence of full-width multiply-adds
+// that the compiler can unroll and vectorise completely
+template <size_t N, size_t M>
+struct StaticLayer
+{
+    static constexpr size_t padded = ((M + PackedBlock - 1) / PackedBlock) * PackedBlock;
+
+    alignas (64) float weights [N][padded] = {};
+    alignas (64) float biases [padded] = {};
+
+    ActivationType activation;
+    bool fast_math;
+
+    void Apply (const float* __restrict input, float* __restrict output) const
     {
-        float stabiliser = 0.000001;
+        alignas (64) float x [padded];
 
-        for (int i = 0; i < depth; i++)
+        // One block of lanes at a time, so the accumulators stay in registers across the whole of k
+        for (size_t block = 0; block < padded; block += PackedBlock)
         {
-            Layer <depth>* layer = layers [i];
-            
-            size_t M = layer -> size.M;
-            size_t N = layer -> size.N;
+            alignas (64) float accumulators [PackedBlock];
 
-            // Update RMSP
-            for (int j = 0; j < M; j++)
+            #pragma omp simd
+            for (size_t lane = 0; lane < PackedBlock; lane++)
             {
-                bias_RMSP [i][j] = decay_rate * bias_RMSP [i][j] + (1 - decay_rate) * pow (bias_gradients [i][j], 2);
-
-                for (int k = 0; k < N; k++)
-                {
-                    weight_RMSP [i][j][k] = decay_rate * weight_RMSP [i][j][k] + (1 - decay_rate) * pow (weight_gradients [i][j][k], 2);
-                };
+                accumulators [lane] = biases [block + lane];
             };
 
-            // Update parameters
-            for (int j = 0; j < M; j++)
+            for (size_t k = 0; k < N; k++)
             {
-                layer -> biases [j] -= learning_rate * bias_gradients [i][j] / sqrt (stabiliser + bias_RMSP [i][j]);
+                const float in = input [k];
 
-                for (int k = 0; k < N; k++)
+                #pragma omp simd
+                for (size_t lane = 0; lane < PackedBlock; lane++)
                 {
-                    layer -> weights [j][k] -= learning_rate * weight_gradients [i][j][k] / sqrt (stabiliser + weight_RMSP [i][j][k]);
+                    accumulators [lane] += weights [k][block + lane] * in;
                 };
             };
+
+            #pragma omp simd
+            for (size_t lane = 0; lane < PackedBlock; lane++)
+            {
+                x [block + lane] = accumulators [lane];
+            };
         };
-    }; 
 
-    void UpdateNesterovRMSProp () 
-    { 
-        for (int i = 0; i < depth; i++)
+        Activate (activation, x, output, M, fast_math);
+    };
+};
+
+// Inference-only copy of a Network whose layer widths are template parameters, eg StaticNetwork <4, 10, 50, 10, 4>.
+// Weights and activations are held inline, so a forward pass touches no heap memory and is thread-safe
+template <size_t... Dims>
+struct StaticNetwork
+{
+    static constexpr size_t depth = sizeof... (Dims) - 1;
+    static constexpr size_t dimensions [depth + 1] = {Dims...};
+
+    template <size_t... I>
+    static std::tuple <StaticLayer <dimensions [I], dimensions [I + 1]>...> __layers (std::index_sequence <I...>);
+
+    typedef decltype (__layers (std::make_index_sequence <depth> ())) Layers;
+    typedef std::tuple <std::array <float, Dims>...> Activations;
+
+    Layers layers;
+    output_fn OutputFunction;
+
+    StaticNetwork (const Network <depth>& network) 
+        : OutputFunction {network.OutputFunction}
+    {
+        for (size_t i = 0; i < depth + 1; i++)
         {
-            Layer <depth>* layer = layers [i];
-            
-            size_t M = layer -> size.M;
-            size_t N = layer -> size.N;
+            assert (network.dimensions [i] == dimensions [i]);
+        };
 
-            // Update RMSP and velocities
-            for (int j = 0; j < M; j++)
-            {
-                bias_RMSP [i][j] = decay_rate * bias_RMSP [i][j] + (1 - decay_rate) * pow (bias_gradients [i][j], 2);
-                bias_velocities [i][j] = momentum * bias_velocities [i][j] - learning_rate * bias_gradients [i][j] / sqrt (bias_RMSP [i][j]);
+        __copy (network, std::make_index_sequence <depth> ());
+    };
 
-                for (int k = 0; k < N; k++)
-                {
-                    weight_RMSP [i][j][k] = decay_rate * weight_RMSP [i][j][k] + (1 - decay_rate) * pow (weight_gradients [i][j][k], 2);
-                    weight_velocities [i][j][k] = momentum * weight_velocities [i][j][k] - learning_rate  * weight_gradients [i][j][k] / sqrt (weight_RMSP [i][j][k]);
-                };
-            };
+    template <size_t... I>
+    void __copy (const Network <depth>& network, std::index_sequence <I...>)
+    {
+        (__copy_layer (*(network.layers [I]), std::get <I> (layers)), ...);
+    };
 
-            // Update parameters
-            for (int j = 0; j < M; j++)
+    template <size_t N, size_t M>
+    static void __copy_layer (const Layer <depth>& source, StaticLayer <N, M>& layer)
+    {
+        for (size_t j = 0; j < M; j++)
+        {
+            for (size_t k = 0; k < N; k++)
             {
-                layer -> biases [j] += bias_velocities [i][j];
-
-                for (int k = 0; k < N; k++)
-                {
-                    layer -> weights [j][k] += weight_velocities [i][j][k];
-                };
+                layer.weights [k][j] = source.weights [j][k];
             };
+
+            layer.biases [j] = source.biases [j];
         };
-    }; 
+
+        layer.activation = source.activation;
+        layer.fast_math = source.fast_math;
+    };
+
+    template <size_t... I>
+    void __forward (Activations& activations, std::index_sequence <I...>) const
+    {
+        (std::get <I> (layers).Apply (std::get <I> (activations).data (), std::get <I + 1> (activations).data ()), ...);
+    };
+
+    void Infer (const float input [], float output []) const
+    {
+        Activations activations;
+
+        std::copy (input, input + dimensions [0], std::get <0> (activations).data ());
+
+        __forward (activations, std::make_index_sequence <depth> ());
+
+        float* y = OutputFunction (std::get <depth> (activations).data (), dimensions [depth]);
+        std::copy (y, y + dimensions [depth], output);
+    };
 };
\ No newline at end of file
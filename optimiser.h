@@ -0,0 +1,467 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+// ***---------  OPTIMISER KERNELS  ---------*** //
+
+// Each kernel updates a flat span of n parameters in a single fused pass, reading the gradients and any
+// optimiser state once and writing the parameters and state once. Arithmetic stays in single precision
+// so the loops vectorise (build with -fopenmp-simd for the pragmas, and -fno-math-errno so sqrt has no branch).
+//
+// decay: coefficient of an L2 term folded into the gradient, g + decay * p
+// Return value: the change in the sum of squared parameters, used to track the regulariser incrementally
+
+float GradientDescentKernel
+(
+    float* __restrict parameters, const float* __restrict gradients, size_t n,
+    float learning_rate, float decay
+)
+{
+    float change = 0.0;
+
+    #pragma omp simd reduction (+:change)
+    for (size_t i = 0; i < n; i++)
+    {
+        const float p = parameters [i];
+        const float delta = - learning_rate * (gradients [i] + decay * p);
+
+        parameters [i] = p + delta;
+        change += delta * (2 * p + delta);
+    };
+
+    return change;
+};
+
+float MomentumKernel
+(
+    float* __restrict parameters, const float* __restrict gradients, float* __restrict velocities, size_t n,
+    float learning_rate, float momentum, float decay
+)
+{
+    float change = 0.0;
+
+    #pragma omp simd reduction (+:change)
+    for (size_t i = 0; i < n; i++)
+    {
+        const float p = parameters [i];
+        const float v = momentum * velocities [i] - learning_rate * (gradients [i] + decay * p);
+
+        velocities [i] = v;
+        parameters [i] = p + v;
+        change += v * (2 * p + v);
+    };
+
+    return change;
+};
+
+// Nesterov look-ahead: moves the parameters along the current velocity before the gradients are evaluated
+float InterimKernel (float* __restrict parameters, const float* __restrict velocities, size_t n, float momentum)
+{
+    float change = 0.0;
+
+    #pragma omp simd reduction (+:change)
+    for (size_t i = 0; i < n; i++)
+    {
+        const float p = parameters [i];
+        const float delta = momentum * velocities [i];
+
+        parameters [i] = p + delta;
+        change += delta * (2 * p + delta);
+    };
+
+    return change;
+};
+
+float RMSPropKernel
+(
+    float* __restrict parameters, const float* __restrict gradients, float* __restrict accumulated, size_t n,
+    float learning_rate, float decay_rate, float decay, float stabiliser
+)
+{
+    float change = 0.0;
+
+    #pragma omp simd reduction (+:change)
+    for (size_t i = 0; i < n; i++)
+    {
+        const float p = parameters [i];
+        const float g = gradients [i] + decay * p;
+        const float r = decay_rate * accumulated [i] + (1 - decay_rate) * g * g;
+        const float delta = - learning_rate * g / std::sqrt (stabiliser + r);
+
+        accumulated [i] = r;
+        parameters [i] = p + delta;
+        change += delta * (2 * p + delta);
+    };
+
+    return change;
+};
+
+float NesterovRMSPropKernel
+(
+    float* __restrict parameters, const float* __restrict gradients, float* __restrict velocities, float* __restrict accumulated, size_t n,
+    float learning_rate, float momentum, float decay_rate, float decay, float stabiliser
+)
+{
+    float change = 0.0;
+
+    #pragma omp simd reduction (+:change)
+    for (size_t i = 0; i < n; i++)
+    {
+        const float p = parameters [i];
+        const float g = gradients [i] + decay * p;
+        const float r = decay_rate * accumulated [i] + (1 - decay_rate) * g * g;
+        const float v = momentum * velocities [i] - learning_rate * g / std::sqrt (stabiliser + r);
+
+        accumulated [i] = r;
+        velocities [i] = v;
+        parameters [i] = p + v;
+        change += v * (2 * p + v);
+    };
+
+    return change;
+};
+
+// Adam with bias-corrected moments. step is the 1-based update count.
+// decay is coupled L2 (Adam), weight_decay is decoupled and applied directly to the parameters (AdamW)
+float AdamKernel
+(
+    float* __restrict parameters, const float* __restrict gradients, float* __restrict first_moments, float* __restrict second_moments, size_t n,
+    float learning_rate, float beta1, float beta2, int step, float decay, float weight_decay, float stabiliser
+)
+{
+    const float step_size = learning_rate / (1 - std::pow (beta1, step));
+    const float second_correction = 1 / (1 - std::pow (beta2, step));
+
+    float change = 0.0;
+
+    #pragma omp simd reduction (+:change)
+    for (size_t i = 0; i < n; i++)
+    {
+        const float p = parameters [i];
+        const float g = gradients [i] + decay * p;
+        const float m = beta1 * first_moments [i] + (1 - beta1) * g;
+        const float v = beta2 * second_moments [i] + (1 - beta2) * g * g;
+        const float delta = - step_size * m / (std::sqrt (v * second_correction) + stabiliser) - learning_rate * weight_decay * p;
+
+        first_moments [i] = m;
+        second_moments [i] = v;
+        parameters [i] = p + delta;
+        change += delta * (2 * p + delta);
+    };
+
+    return change;
+};
+
+// Gradient descent on parameters shared with other threads that update them without locks (Hogwild). Each element
+// is read and written with relaxed atomic loads and stores, so no value is ever torn, but concurrent updates to the
+// same element may overwrite each other. Consumes the gradients, leaving them zeroed for the next example
+void HogwildKernel (float* parameters, float* __restrict gradients, size_t n, float learning_rate, float decay)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float p;
+        __atomic_load (parameters + i, &p, __ATOMIC_RELAXED);
+
+        p += - learning_rate * (gradients [i] + decay * p);
+        gradients [i] = 0.0;
+
+        __atomic_store (parameters + i, &p, __ATOMIC_RELAXED);
+    };
+};
+
+// Reads a parameter that Hogwild threads may be updating, with a relaxed atomic load so the value is never torn
+float RelaxedLoad (const float* parameter)
+{
+    float p;
+    __atomic_load (parameter, &p, __ATOMIC_RELAXED);
+
+    return p;
+};
+
+
+// ***---------  OPTIMISERS  ---------*** //
+
+// A flat block of parameters and the matching block of gradients
+struct ParameterSpan
+{
+    float* parameters;
+    float* gradients;
+    size_t length;
+    bool regularised; // receives weight decay and counts towards the regulariser
+};
+
+// Allocates one zeroed buffer per span
+float** AllocateState (const ParameterSpan spans [], size_t count)
+{
+    float** state = new float* [count];
+
+    for (size_t i = 0; i < count; i++)
+    {
+        state [i] = new float [spans [i].length]();
+    };
+
+    return state;
+};
+
+void FreeState (float** state, size_t count)
+{
+    if (state == nullptr) return;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        delete [] state [i];
+    };
+
+    delete [] state;
+};
+
+// Owns whatever per-parameter state its update rule needs, allocated on the first Step so that
+// memory scales with the chosen method rather than with every method the Network supports
+struct Optimiser
+{
+    virtual ~Optimiser () {};
+
+    // Applies one update to every span and returns the change in the sum of squares of the regularised spans.
+    // decay is the L2 coefficient folded into the gradients of regularised spans
+    virtual float Step (const ParameterSpan spans [], size_t count, float learning_rate, float decay) = 0;
+
+    // Nesterov look-ahead along the current velocities, a no-op for optimisers without velocities
+    virtual float Lookahead (const ParameterSpan spans [], size_t count) 
+    { 
+        return 0.0; 
+    };
+};
+
+struct GradientDescent : Optimiser
+{
+    float Step (const ParameterSpan spans [], size_t count, float learning_rate, float decay) override
+    {
+        float change = 0.0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const ParameterSpan& s = spans [i];
+            const float c = GradientDescentKernel (s.parameters, s.gradients, s.length, learning_rate, s.regularised ? decay : 0.0);
+
+            if (s.regularised) change += c;
+        };
+
+        return change;
+    };
+};
+
+struct Momentum : Optimiser
+{
+    const float momentum;
+
+    float** velocities = nullptr;
+    size_t count = 0;
+
+    Momentum (float momentum) : momentum {momentum} {};
+
+    ~Momentum ()
+    {
+        FreeState (velocities, count);
+    };
+
+    float Step (const ParameterSpan spans [], size_t count, float learning_rate, float decay) override
+    {
+        if (velocities == nullptr)
+        {
+            velocities = AllocateState (spans, count);
+            this -> count = count;
+        };
+
+        float change = 0.0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const ParameterSpan& s = spans [i];
+            const float c = MomentumKernel (s.parameters, s.gradients, velocities [i], s.length, learning_rate, momentum, s.regularised ? decay : 0.0);
+
+            if (s.regularised) change += c;
+        };
+
+        return change;
+    };
+
+    float Lookahead (const ParameterSpan spans [], size_t count) override
+    {
+        float change = 0.0;
+
+        // Velocities start at zero, so there is nothing to look ahead along before the first step
+        if (velocities == nullptr) return change;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const ParameterSpan& s = spans [i];
+            const float c = InterimKernel (s.parameters, velocities [i], s.length, momentum);
+
+            if (s.regularised) change += c;
+        };
+
+        return change;
+    };
+};
+
+struct RMSProp : Optimiser
+{
+    const float decay_rate;
+    const float stabiliser;
+
+    float** accumulated = nullptr;
+    size_t count = 0;
+
+    RMSProp (float decay_rate, float stabiliser = 0.000001) : decay_rate {decay_rate}, stabiliser {stabiliser} {};
+
+    ~RMSProp ()
+    {
+        FreeState (accumulated, count);
+    };
+
+    float Step (const ParameterSpan spans [], size_t count, float learning_rate, float decay) override
+    {
+        if (accumulated == nullptr)
+        {
+            accumulated = AllocateState (spans, count);
+            this -> count = count;
+        };
+
+        float change = 0.0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const ParameterSpan& s = spans [i];
+            const float c = RMSPropKernel (s.parameters, s.gradients, accumulated [i], s.length, learning_rate, decay_rate, s.regularised ? decay : 0.0, stabiliser);
+
+            if (s.regularised) change += c;
+        };
+
+        return change;
+    };
+};
+
+struct NesterovRMSProp : Optimiser
+{
+    const float momentum;
+    const float decay_rate;
+    const float stabiliser;
+
+    float** velocities = nullptr;
+    float** accumulated = nullptr;
+    size_t count = 0;
+
+    NesterovRMSProp (float momentum, float decay_rate, float stabiliser = 0.000001) 
+        : momentum {momentum}, decay_rate {decay_rate}, stabiliser {stabiliser} 
+    {};
+
+    ~NesterovRMSProp ()
+    {
+        FreeState (velocities, count);
+        FreeState (accumulated, count);
+    };
+
+    float Step (const ParameterSpan spans [], size_t count, float learning_rate, float decay) override
+    {
+        if (velocities == nullptr)
+        {
+            velocities = AllocateState (spans, count);
+            accumulated = AllocateState (spans, count);
+            this -> count = count;
+        };
+
+        float change = 0.0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const ParameterSpan& s = spans [i];
+            const float c = NesterovRMSPropKernel 
+            (
+                s.parameters, s.gradients, velocities [i], accumulated [i], s.length, 
+                learning_rate, momentum, decay_rate, s.regularised ? decay : 0.0, stabiliser
+            );
+
+            if (s.regularised) change += c;
+        };
+
+        return change;
+    };
+
+    float Lookahead (const ParameterSpan spans [], size_t count) override
+    {
+        float change = 0.0;
+
+        if (velocities == nullptr) return change;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const ParameterSpan& s = spans [i];
+            const float c = InterimKernel (s.parameters, velocities [i], s.length, momentum);
+
+            if (s.regularised) change += c;
+        };
+
+        return change;
+    };
+};
+
+// decoupled: apply decay directly to the parameters (AdamW) rather than through the gradients (Adam)
+struct Adam : Optimiser
+{
+    const float beta1;
+    const float beta2;
+    const bool decoupled;
+    const float stabiliser;
+
+    float** first_moments = nullptr;
+    float** second_moments = nullptr;
+    size_t count = 0;
+    int step = 0;
+
+    Adam (float beta1 = 0.9, float beta2 = 0.999, bool decoupled = false, float stabiliser = 0.000001) 
+        : beta1 {beta1}, beta2 {beta2}, decoupled {decoupled}, stabiliser {stabiliser} 
+    {};
+
+    ~Adam ()
+    {
+        FreeState (first_moments, count);
+        FreeState (second_moments, count);
+    };
+
+    float Step (const ParameterSpan spans [], size_t count, float learning_rate, float decay) override
+    {
+        if (first_moments == nullptr)
+        {
+            first_moments = AllocateState (spans, count);
+            second_moments = AllocateState (spans, count);
+            this -> count = count;
+        };
+
+        step++;
+
+        float change = 0.0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const ParameterSpan& s = spans [i];
+            const float d = s.regularised ? decay : 0.0;
+            const float c = AdamKernel 
+            (
+                s.parameters, s.gradients, first_moments [i], second_moments [i], s.length, 
+                learning_rate, beta1, beta2, step, decoupled ? 0.0 : d, decoupled ? d : 0.0, stabiliser
+            );
+
+            if (s.regularised) change += c;
+        };
+
+        return change;
+    };
+};
+
+struct AdamW : Adam
+{
+    AdamW (float beta1 = 0.9, float beta2 = 0.999, float stabiliser = 0.000001) 
+        : Adam (beta1, beta2, true, stabiliser) 
+    {};
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// ***---------  THREAD POOL  ---------*** //
+
+// A fixed set of worker threads running one parallel loop at a time. Run hands out task indices from a shared
+// counter, so which thread runs a task is not deterministic; callers that need reproducible results must make
+// each task's output depend only on its index. The calling thread takes tasks as well, so a pool of size 1
+// has no workers and runs everything inline.
+struct ThreadPool
+{
+    std::thread* workers;
+    size_t size;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    // The current loop, written under mutex before the generation is advanced
+    const std::function <void (size_t)>* task = nullptr;
+    size_t tasks = 0;
+    size_t generation = 0;
+    size_t done = 0; // workers that have finished the current loop
+    bool stop = false;
+
+    std::atomic <size_t> next {0};
+
+    ThreadPool (size_t size = std::thread::hardware_concurrency ())
+        : size {size > 0 ? size : 1}
+    {
+        workers = new std::thread [this -> size - 1];
+
+        for (size_t i = 0; i + 1 < this -> size; i++)
+        {
+            workers [i] = std::thread ([this] () { __worker (); });
+        };
+    };
+
+    ~ThreadPool ()
+    {
+        {
+            std::lock_guard <std::mutex> lock (mutex);
+            stop = true;
+        };
+
+        wake.notify_all ();
+
+        for (size_t i = 0; i + 1 < size; i++)
+        {
+            workers [i].join ();
+        };
+
+        delete [] workers;
+    };
+
+    ThreadPool (const ThreadPool&) = delete;
+
+    // Calls f (i) for every i in [0, tasks) and returns once all of them have finished
+    void Run (size_t tasks, const std::function <void (size_t)>& f)
+    {
+        if (tasks == 0) return;
+
+        {
+            std::lock_guard <std::mutex> lock (mutex);
+
+            task = &f;
+            this -> tasks = tasks;
+            next = 0;
+            done = 0;
+            generation++;
+        };
+
+        wake.notify_all ();
+
+        __work ();
+
+        // Every worker takes part in every loop, even if only to find no tasks left, so none of them can
+        // wake late and take a task of the next loop with this one's function
+        std::unique_lock <std::mutex> lock (mutex);
+        finished.wait (lock, [&] () { return done == size - 1; });
+    };
+
+    void __work ()
+    {
+        for (size_t i = next++; i < tasks; i = next++)
+        {
+            (*task) (i);
+        };
+    };
+
+    void __worker ()
+    {
+        size_t seen = 0;
+
+        while (true)
+        {
+            {
+                std::unique_lock <std::mutex> lock (mutex);
+                wake.wait (lock, [&] () { return stop || generation != seen; });
+
+                if (stop) return;
+
+                seen = generation;
+            };
+
+            __work ();
+
+            {
+                std::lock_guard <std::mutex> lock (mutex);
+                done++;
+            };
+
+            finished.notify_one ();
+        };
+    };
+};
+
+
+// ***---------  SPSC QUEUE  ---------*** //
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread. The release store of tail
+// publishes the item and everything the producer wrote before pushing it, so items can hand over whole buffers
+template <typename T, size_t capacity>
+struct SPSCQueue
+{
+    static_assert ((capacity & (capacity - 1)) == 0, "SPSCQueue capacity must be a power of two");
+
+    T items [capacity];
+
+    // On separate cache lines, so producer and consumer only share a line when one reads the other's index
+    alignas (64) std::atomic <size_t> head {0}; // next item to pop, written by the consumer
+    alignas (64) std::atomic <size_t> tail {0}; // next free slot, written by the producer
+
+    bool TryPush (const T& item)
+    {
+        const size_t t = tail.load (std::memory_order_relaxed);
+
+        if (t - head.load (std::memory_order_acquire) == capacity) return false;
+
+        items [t % capacity] = item;
+        tail.store (t + 1, std::memory_order_release);
+
+        return true;
+    };
+
+    bool TryPop (T& item)
+    {
+        const size_t h = head.load (std::memory_order_relaxed);
+
+        if (tail.load (std::memory_order_acquire) == h) return false;
+
+        item = items [h % capacity];
+        head.store (h + 1, std::memory_order_release);
+
+        return true;
+    };
+
+    // Blocking versions, which spin but yield so that oversubscribed cores still make progress
+    void Push (const T& item)
+    {
+        while (!TryPush (item)) std::this_thread::yield ();
+    };
+
+    T Pop ()
+    {
+        T item;
+        while (!TryPop (item)) std::this_thread::yield ();
+
+        return item;
+    };
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include <cmath>
+#include <algorithm>
 
 #if DEBUG_LEVEL == 1
     #include <string>
@@ -229,6 +230,82 @@ void MatrixMultiply (const Tensor <T, 2>& V, const Tensor <T, 2>& W, Tensor <T,
     };
 };
 
+// C = A' B' (or C += A' B' if accumulate) on row-major matrices addressed by leading dimensions lda, ldb and ldc, so
+// submatrices and strided rows need no copies. A' is m x k: A [m][k], or A [k][m] read transposed if TransposeA.
+// B' is k x n: B [k][n], or B [n][k] read transposed if TransposeB. Each case orders its loops so the innermost one
+// runs along contiguous memory and vectorises
+template <bool TransposeA, bool TransposeB, typename T>
+void Gemm (size_t m, size_t n, size_t k, const T* A, size_t lda, const T* B, size_t ldb, T* C, size_t ldc, bool accumulate = false)
+{
+    if (!accumulate)
+    {
+        for (size_t i = 0; i < m; i++)
+        {
+            std::fill (C + i * ldc, C + i * ldc + n, (T)0);
+        };
+    };
+
+    if (!TransposeA && TransposeB)
+    {
+        // Dot products of rows of A with rows of B
+        for (size_t i = 0; i < m; i++)
+        {
+            const T* a = A + i * lda;
+
+            for (size_t j = 0; j < n; j++)
+            {
+                const T* b = B + j * ldb;
+                T sum = 0;
+
+                #pragma omp simd reduction (+:sum)
+                for (size_t p = 0; p < k; p++)
+                {
+                    sum += a [p] * b [p];
+                };
+
+                C [i * ldc + j] += sum;
+            };
+        };
+    }
+    else if (!TransposeB)
+    {
+        // Rank one updates of each row of C by the rows of B
+        for (size_t i = 0; i < m; i++)
+        {
+            T* c = C + i * ldc;
+
+            for (size_t p = 0; p < k; p++)
+            {
+                const T a = TransposeA ? A [p * lda + i] : A [i * lda + p];
+                const T* b = B + p * ldb;
+
+                #pragma omp simd
+                for (size_t j = 0; j < n; j++)
+                {
+                    c [j] += a * b [j];
+                };
+            };
+        };
+    }
+    else
+    {
+        for (size_t i = 0; i < m; i++)
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                T sum = 0;
+
+                for (size_t p = 0; p < k; p++)
+                {
+                    sum += A [p * lda + i] * B [j * ldb + p];
+                };
+
+                C [i * ldc + j] += sum;
+            };
+        };
+    };
+};
+
 template <typename T, size_t N>
 struct Tensor
 {
@@ -770,4 +847,140 @@ struct Tensor <T, 1>
             elements [i] = distribution (generator);
         };
     };
-};
\ No newline at end of file
+};
+// Sequences of different lengths stored back to back, each step width values wide. Sequence i occupies steps
+// offsets [i] to offsets [i + 1], so no storage is spent on padding
+template <typename T>
+struct JaggedTensor
+{
+    T* elements;
+    size_t* offsets; // [count + 1]
+    size_t count;
+    size_t width;
+
+    JaggedTensor (const size_t lengths [], size_t count, size_t width) : count {count}, width {width}
+    {
+        offsets = new size_t [count + 1];
+        offsets [0] = 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            offsets [i + 1] = offsets [i] + lengths [i];
+        };
+
+        elements = new T [offsets [count] * width]{};
+    };
+
+    ~JaggedTensor ()
+    {
+        delete [] elements;
+        delete [] offsets;
+    };
+
+    JaggedTensor (const JaggedTensor&) = delete;
+
+    size_t Length (size_t i) const
+    {
+        return offsets [i + 1] - offsets [i];
+    };
+
+    // Total steps over all sequences
+    size_t Steps () const
+    {
+        return offsets [count];
+    };
+
+    T* operator[] (size_t i)
+    {
+        return elements + offsets [i] * width;
+    };
+
+    const T* operator[] (size_t i) const
+    {
+        return elements + offsets [i] * width;
+    };
+};
+
+// A JaggedTensor rearranged timestep-major for recurrent layers. The sequences are sorted longest first, so the
+// ones still running at timestep t are always the first batch_sizes [t], and timestep t is the contiguous block of
+// batch_sizes [t] rows starting at row step_offsets [t]. Each timestep is then one dense matrix over exactly the
+// active sequences, and the previous timestep's rows for them are the prefix of its block
+template <typename T>
+struct PackedSequence
+{
+    T* elements;
+    size_t* batch_sizes;  // [max_length]
+    size_t* step_offsets; // [max_length + 1]
+    size_t* order;        // [count], the sequence at each packed position, longest first
+    size_t count;
+    size_t width;
+    size_t max_length;
+
+    PackedSequence (const JaggedTensor <T>& sequences) : count {sequences.count}, width {sequences.width}
+    {
+        order = new size_t [count];
+
+        for (size_t i = 0; i < count; i++)
+        {
+            order [i] = i;
+        };
+
+        // Stable, so equal lengths keep their order
+        std::stable_sort (order, order + count, [&] (size_t a, size_t b) { return sequences.Length (a) > sequences.Length (b); });
+
+        max_length = (count > 0) ? sequences.Length (order [0]) : 0;
+
+        batch_sizes = new size_t [max_length];
+        step_offsets = new size_t [max_length + 1];
+        step_offsets [0] = 0;
+
+        size_t active = count;
+
+        for (size_t t = 0; t < max_length; t++)
+        {
+            while (sequences.Length (order [active - 1]) <= t) active--;
+
+            batch_sizes [t] = active;
+            step_offsets [t + 1] = step_offsets [t] + active;
+        };
+
+        elements = new T [Rows () * width];
+
+        for (size_t t = 0; t < max_length; t++)
+        {
+            for (size_t b = 0; b < batch_sizes [t]; b++)
+            {
+                const T* step = sequences [order [b]] + t * width;
+                std::copy (step, step + width, elements + (step_offsets [t] + b) * width);
+            };
+        };
+    };
+
+    ~PackedSequence ()
+    {
+        delete [] elements;
+        delete [] batch_sizes;
+        delete [] step_offsets;
+        delete [] order;
+    };
+
+    PackedSequence (const PackedSequence&) = delete;
+
+    size_t Rows () const
+    {
+        return step_offsets [max_length];
+    };
+
+    // Scatters rows laid out like this packing, width values each, back into sequences of the original order
+    void Unpack (const T* packed, JaggedTensor <T>& sequences) const
+    {
+        for (size_t t = 0; t < max_length; t++)
+        {
+            for (size_t b = 0; b < batch_sizes [t]; b++)
+            {
+                const T* row = packed + (step_offsets [t] + b) * width;
+                std::copy (row, row + width, sequences [order [b]] + t * width);
+            };
+        };
+    };
+};
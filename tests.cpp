@@ -8,10 +8,14 @@
     #include <string>
 #endif
 
+#include <thread>
+#include <sys/wait.h>
+
 #include "./ml.h"
 #include "./tensor.h"
 #include "./benchmark.h"
 #include "./regression.h"
+#include "./distributed.h"
 
 void test_function (float x [4], float* y) 
 {
@@ -27,8 +31,7 @@ void run_net ()
 {
     // Initialise Network
     size_t dimensions [5] = {4, 10, 50, 10, 4};
-    activation_fn functions [4] = {ReLU, ReLU, ReLU, ReLU};
-    activation_fn derivatives [4] = {Step, Step, Step, Step};
+    ActivationType functions [4] = {relu, relu, relu, relu};
     float reg_factor = 0.5;
     float learn_rate = 1;
     float learn_rate_time_constant = 300;
@@ -40,7 +43,6 @@ void run_net ()
     Network <4> network (
         dimensions, 
         functions, 
-        derivatives, 
         Identity, 
         MeanSquaredError, 
         MeanSquaredErrorGradient, 
@@ -84,6 +86,8 @@ void run_net ()
     float* costs = network.GD_StochasticNesterov (input, expected, size, batch_size);
     // float* costs = network.GD_RMSProp (input, expected, size, batch_size);
     // float* costs = network.GD_RMSPropNesterov (input, expected, size, batch_size);
+    // float* costs = network.GD_Adam (input, expected, size, batch_size);
+    // float* costs = network.GD_AdamW (input, expected, size, batch_size);
 
     // Process Results
     std::ofstream out;
@@ -778,10 +782,1514 @@ void test_recurrent_layer ()
     system ("python graph.py losses.csv --fit");
 };
 
+// Sequences per second and loss of the recurrent layer trained one sequence at a time against batches of sequences
+void test_batched_recurrent_layer ()
+{
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    const size_t timesteps = 4;
+    const size_t dimension = 4;
+    const size_t stride = timesteps * dimension;
+
+    float* input = new float [EXAMPLES * stride]{};
+    float* expected = new float [EXAMPLES * stride]{};
+
+    for (uint i = 0; i < EXAMPLES; i++)
+    {
+        const float value = distribution (generator);
+
+        for (uint j = 0; j < timesteps; j++)
+        {
+            input [i * stride + j * dimension + j % dimension] = value;
+            expected [i * stride + j * dimension + (j + 1) % dimension] = 1.0;
+        };
+    };
+
+    const size_t batch_sizes [4] = {1, 8, 32, 128};
+
+    for (size_t batch : batch_sizes)
+    {
+        RecurrentLayer <float> layer (dimension, timesteps);
+
+        size_t batch_dimensions [3] = {batch, timesteps, dimension};
+        const size_t batches = EXAMPLES / batch;
+
+        float loss = 0.0;
+        size_t counted = 0;
+
+        const auto start = std::chrono::steady_clock::now ();
+
+        for (size_t i = 0; i < batches; i++)
+        {
+            Tensor <float, 3> input_batch (batch_dimensions, input + i * batch * stride, 1);
+            Tensor <float, 3> expected_batch (batch_dimensions, expected + i * batch * stride, 1);
+
+            const float cost = layer.BackPropagate (input_batch, expected_batch);
+
+            if (i * batch >= EXAMPLES - 1000)
+            {
+                loss += cost * batch;
+                counted += batch;
+            };
+        };
+
+        const auto end = std::chrono::steady_clock::now ();
+        const double seconds = std::chrono::duration <double> (end - start).count ();
+
+        std::cout << "batch " << batch << ": " << batches * batch / seconds << " sequences/s, final loss " << loss / counted << std::endl;
+    };
+
+    delete [] input;
+    delete [] expected;
+};
+
+// Trains a recurrent layer on batches of the sequences and prints the time per timestep and the final loss
+template <typename Layer>
+void train_recurrent (const char* name, Layer& layer, float* input, float* expected, size_t sequences, size_t batch)
+{
+    const size_t stride = layer.timesteps * layer.dimension;
+    size_t batch_dimensions [3] = {batch, layer.timesteps, layer.dimension};
+    const size_t batches = sequences / batch;
+
+    float loss = 0.0;
+
+    const auto start = std::chrono::steady_clock::now ();
+
+    for (size_t i = 0; i < batches; i++)
+    {
+        Tensor <float, 3> input_batch (batch_dimensions, input + i * batch * stride, 1);
+        Tensor <float, 3> expected_batch (batch_dimensions, expected + i * batch * stride, 1);
+
+        const float cost = layer.BackPropagate (input_batch, expected_batch);
+
+        if (i + 10 >= batches) loss += cost / 10;
+    };
+
+    const auto end = std::chrono::steady_clock::now ();
+    const double timesteps = (double)batches * layer.timesteps;
+
+    std::cout << name << ": " << std::chrono::duration <double, std::micro> (end - start).count () / timesteps << " us per timestep of the batch, final loss " << loss << std::endl;
+};
+
+// Weights of a layer and the gradient its BackPropagate leaves for them
+struct Parameter
+{
+    const char* name;
+    float* weights;
+    const float* gradient;
+    size_t length;
+};
+
+// Checks the gradients of a layer against central differences of its cross-entropy loss over a small random
+// batch, with learning rate 0 so BackPropagate leaves the weights alone. The weights are drawn large enough that
+// every gate matters. Prints the largest error of each parameter relative to the larger of 1 and the difference
+template <typename Layer>
+void check_recurrent_gradients (const char* name, Layer& layer, std::initializer_list <Parameter> parameters)
+{
+    std::mt19937 generator (SEED);
+    std::normal_distribution <float> distribution (0.0, 0.5);
+
+    const size_t batch = 3;
+    const size_t length = batch * layer.timesteps * layer.dimension;
+
+    for (const Parameter& p : parameters)
+    {
+        for (uint i = 0; i < p.length; i++) p.weights [i] = distribution (generator);
+    };
+
+    float* input = new float [length];
+    float* expected = new float [length]{};
+
+    for (uint i = 0; i < length; i++) input [i] = 2 * distribution (generator);
+    for (uint r = 0; r < batch * layer.timesteps; r++) expected [r * layer.dimension + r % layer.dimension] = 1.0;
+
+    size_t dimensions [3] = {batch, layer.timesteps, layer.dimension};
+    Tensor <float, 3> input_batch (dimensions, input, 1);
+    Tensor <float, 3> expected_batch (dimensions, expected, 1);
+
+    auto loss = [&] ()
+    {
+        layer.Propagate (input_batch);
+
+        double total = 0.0;
+        for (uint i = 0; i < length; i++) total -= expected [i] * std::log ((double)layer.batch_probabilities [i]);
+
+        return total;
+    };
+
+    layer.BackPropagate (input_batch, expected_batch);
+
+    std::cout << name << " gradient error:";
+
+    for (const Parameter& p : parameters)
+    {
+        const float h = 2e-3;
+        double worst = 0.0;
+
+        for (uint i = 0; i < p.length; i++)
+        {
+            const float w = p.weights [i];
+
+            p.weights [i] = w + h;
+            const double above = loss ();
+            p.weights [i] = w - h;
+            const double below = loss ();
+            p.weights [i] = w;
+
+            const double difference = (above - below) / (2 * h);
+            worst = std::max (worst, std::fabs (difference - p.gradient [i]) / std::max (1.0, std::fabs (difference)));
+        };
+
+        std::cout << " " << p.name << " " << worst;
+    };
+
+    std::cout << std::endl;
+
+    delete [] input;
+    delete [] expected;
+};
+
+// LSTM and GRU against the vanilla recurrent layer on predicting the next one-hot vector of a sequence, which needs the
+// position in the sequence rather than the current input
+void test_gated_recurrent_layers ()
+{
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    const size_t timesteps = 16;
+    const size_t dimension = 16;
+    const size_t stride = timesteps * dimension;
+    const size_t sequences = 20000;
+    const size_t batch = 32;
+
+    float* input = new float [sequences * stride]{};
+    float* expected = new float [sequences * stride]{};
+
+    for (uint i = 0; i < sequences; i++)
+    {
+        const float value = distribution (generator);
+
+        for (uint j = 0; j < timesteps; j++)
+        {
+            input [i * stride + j * dimension] = (j == 0) ? value : 0.0;
+            expected [i * stride + j * dimension + (j + 1) % dimension] = 1.0;
+        };
+    };
+
+    LSTMLayer <float> lstm_check (4, 5, 0.0);
+
+    check_recurrent_gradients ("LSTMLayer", lstm_check, {
+        {"input",  lstm_check.input_weights         -> elements, lstm_check.input_weights_gradient,  4 * 4 * 4},
+        {"hidden", lstm_check.hidden_weights        -> elements, lstm_check.hidden_weights_gradient, 4 * 4 * 4},
+        {"output", lstm_check.hidden_output_weights -> elements, lstm_check.hidden_output_gradient,  4 * 4},
+        {"gate biases",   lstm_check.gate_biases    -> elements, lstm_check.gate_biases_gradient,    4 * 4},
+        {"output biases", lstm_check.output_biases  -> elements, lstm_check.output_biases_gradient,  4}});
+
+    GRULayer <float> gru_check (4, 5, 0.0);
+
+    check_recurrent_gradients ("GRULayer", gru_check, {
+        {"input",  gru_check.input_weights         -> elements, gru_check.input_weights_gradient,  3 * 4 * 4},
+        {"hidden", gru_check.hidden_weights        -> elements, gru_check.hidden_weights_gradient, 3 * 4 * 4},
+        {"output", gru_check.hidden_output_weights -> elements, gru_check.hidden_output_gradient,  4 * 4},
+        {"input biases",  gru_check.input_biases   -> elements, gru_check.input_biases_gradient,   3 * 4},
+        {"hidden biases", gru_check.hidden_biases  -> elements, gru_check.hidden_biases_gradient,  3 * 4},
+        {"output biases", gru_check.output_biases  -> elements, gru_check.output_biases_gradient,  4}});
+
+    // Plain and checkpointed, with an interval that does not divide the 5 timesteps
+    for (size_t interval : {0, 2})
+    {
+        RecurrentLayer <float> recurrent_check (4, 5, 0.0);
+        recurrent_check.UseCheckpointing (interval);
+
+        check_recurrent_gradients (interval ? "RecurrentLayer checkpointed" : "RecurrentLayer", recurrent_check, {
+            {"input",  recurrent_check.input_hidden_weights  -> elements, recurrent_check.input_hidden_gradient,  4 * 4},
+            {"hidden", recurrent_check.hidden_hidden_weights -> elements, recurrent_check.hidden_hidden_gradient, 4 * 4},
+            {"output", recurrent_check.hidden_output_weights -> elements, recurrent_check.hidden_output_gradient, 4 * 4},
+            {"input biases",  recurrent_check.x_biases      -> elements, recurrent_check.x_biases_gradient,      4},
+            {"output biases", recurrent_check.output_biases -> elements, recurrent_check.output_biases_gradient, 4}});
+    };
+
+    RecurrentLayer <float> recurrent (dimension, timesteps, 0.1);
+    LSTMLayer <float> lstm (dimension, timesteps, 0.5);
+    GRULayer <float> gru (dimension, timesteps, 0.05);
+
+    train_recurrent ("RecurrentLayer", recurrent, input, expected, sequences, batch);
+    train_recurrent ("LSTMLayer", lstm, input, expected, sequences, batch);
+    train_recurrent ("GRULayer", gru, input, expected, sequences, batch);
+
+    delete [] input;
+    delete [] expected;
+};
+
+// Wavefront scheduling of a 4 layer recurrent stack, serial against the thread pool. Each cell's result depends
+// only on its inputs, so both runs must finish with the same probabilities
+void test_recurrent_network ()
+{
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    const size_t timesteps = 32;
+    const size_t dimension = 64;
+    const size_t layers = 4;
+    const size_t stride = timesteps * dimension;
+    const size_t batch = 32;
+    const size_t batches = 50;
+
+    float* input = new float [batch * batches * stride]{};
+    float* expected = new float [batch * batches * stride]{};
+
+    for (uint i = 0; i < batch * batches; i++)
+    {
+        const float value = distribution (generator);
+
+        for (uint j = 0; j < timesteps; j++)
+        {
+            input [i * stride + j * dimension] = (j == 0) ? value : 0.0;
+            expected [i * stride + j * dimension + (j + 1) % dimension] = 1.0;
+        };
+    };
+
+    size_t batch_dimensions [3] = {batch, timesteps, dimension};
+    float* reference = new float [batch * stride];
+
+    ThreadPool pool (layers);
+
+    // Gradients of a small 3 layer stack, serial and on the pool
+    for (ThreadPool* threads : {(ThreadPool*)nullptr, &pool})
+    {
+        RecurrentNetwork <float> check (4, 5, 3, 0.0);
+        check.UseThreads (threads);
+
+        check_recurrent_gradients (threads ? "RecurrentNetwork on the pool" : "RecurrentNetwork", check, {
+            {"input 0",  check.input_weights [0]     -> elements, check.input_weights_gradient [0],  4 * 4},
+            {"hidden 0", check.hidden_weights [0]    -> elements, check.hidden_weights_gradient [0], 4 * 4},
+            {"biases 0", check.biases [0]            -> elements, check.biases_gradient [0],         4},
+            {"input 2",  check.input_weights [2]     -> elements, check.input_weights_gradient [2],  4 * 4},
+            {"hidden 2", check.hidden_weights [2]    -> elements, check.hidden_weights_gradient [2], 4 * 4},
+            {"biases 2", check.biases [2]            -> elements, check.biases_gradient [2],         4},
+            {"output",   check.hidden_output_weights -> elements, check.hidden_output_gradient,      4 * 4},
+            {"output biases", check.output_biases    -> elements, check.output_biases_gradient,      4}});
+    };
+
+    for (ThreadPool* threads : {(ThreadPool*)nullptr, &pool})
+    {
+        RecurrentNetwork <float> network (dimension, timesteps, layers, 0.1);
+        network.UseThreads (threads);
+
+        float loss = 0.0;
+
+        const auto start = std::chrono::steady_clock::now ();
+
+        for (size_t i = 0; i < batches; i++)
+        {
+            Tensor <float, 3> input_batch (batch_dimensions, input + i * batch * stride, 1);
+            Tensor <float, 3> expected_batch (batch_dimensions, expected + i * batch * stride, 1);
+
+            loss = network.BackPropagate (input_batch, expected_batch);
+        };
+
+        const auto end = std::chrono::steady_clock::now ();
+
+        bool matches = true;
+
+        if (threads == nullptr)
+        {
+            std::copy (network.batch_probabilities, network.batch_probabilities + batch * stride, reference);
+        }
+        else
+        {
+            matches = std::equal (reference, reference + batch * stride, network.batch_probabilities);
+        };
+
+        std::cout << (threads ? threads -> size : 1) << " threads: " << std::chrono::duration <double> (end - start).count () << " s, final loss " << loss << ", matches serial: " << matches << std::endl;
+    };
+
+    delete [] input;
+    delete [] expected;
+    delete [] reference;
+};
+
+// Truncated BPTT over sequences far longer than the layer's timesteps. The layer only ever holds one chunk of
+// 16 steps per sequence, with the hidden state carried from chunk to chunk
+void test_truncated_bptt ()
+{
+    const size_t chunk = 16;
+    const size_t dimension = 8;
+    const size_t length = 1 << 16;
+    const size_t batch = 4;
+    const size_t period = 5;
+
+    // Periodic one-hot sequences with a different phase each, to be predicted one step ahead
+    float* input = new float [batch * length * dimension]{};
+    float* expected = new float [batch * length * dimension]{};
+
+    for (uint b = 0; b < batch; b++)
+    {
+        for (uint t = 0; t < length; t++)
+        {
+            input    [(b * length + t) * dimension + (b + t) % period] = 1.0;
+            expected [(b * length + t) * dimension + (b + t + 1) % period] = 1.0;
+        };
+    };
+
+    size_t dimensions [3] = {batch, length, dimension};
+    Tensor <float, 3> input_sequences (dimensions, input, 1);
+    Tensor <float, 3> expected_sequences (dimensions, expected, 1);
+
+    RecurrentLayer <float> layer (dimension, chunk, 0.001);
+
+    for (uint epoch = 0; epoch < 5; epoch++)
+    {
+        const auto start = std::chrono::steady_clock::now ();
+        const float loss = layer.BackPropagateTruncated (input_sequences, expected_sequences);
+        const auto end = std::chrono::steady_clock::now ();
+
+        std::cout << "epoch " << epoch << ": " << std::chrono::duration <double> (end - start).count () << " s, loss per chunk " << loss << std::endl;
+    };
+
+    std::cout << "sequence of " << length << " steps, layer buffers of " << batch * chunk * dimension * 10 * sizeof (float) << " bytes" << std::endl;
+
+    delete [] input;
+    delete [] expected;
+};
+
+// Streaming inference with Step against recomputing the window with Propagate, generation with the alias
+// sampler, and restoring a snapshot of the stream
+void test_streaming ()
+{
+    std::mt19937 generator (SEED);
+
+    const size_t timesteps = 64;
+    const size_t dimension = 32;
+    size_t dimensions [2] = {timesteps, dimension};
+
+    RecurrentLayer <float> layer (dimension, timesteps);
+
+    float input [timesteps * dimension] = {};
+    std::uniform_int_distribution <size_t> token (0, dimension - 1);
+
+    for (uint t = 0; t < timesteps; t++)
+    {
+        input [t * dimension + token (generator)] = 1.0;
+    };
+
+    Tensor <float, 2> sequence (dimensions, input);
+    layer.Propagate (sequence);
+
+    // Step through the same sequence one token at a time
+    float difference = 0.0;
+    double step_time = 0.0;
+
+    for (uint t = 0; t < timesteps; t++)
+    {
+        const auto start = std::chrono::steady_clock::now ();
+        const float* p = layer.Step (input + t * dimension);
+        const auto end = std::chrono::steady_clock::now ();
+
+        step_time += std::chrono::duration <double, std::micro> (end - start).count ();
+
+        for (uint j = 0; j < dimension; j++)
+        {
+            difference = std::max (difference, std::fabs (p [j] - layer.probabilities -> elements [t * dimension + j]));
+        };
+    };
+
+    const auto start = std::chrono::steady_clock::now ();
+    layer.Propagate (sequence);
+    const auto end = std::chrono::steady_clock::now ();
+
+    std::cout << "Step: " << step_time / timesteps << " us per token, Propagate over " << timesteps << " steps: " << std::chrono::duration <double, std::micro> (end - start).count () << " us, max difference " << difference << std::endl;
+
+    // The same snapshot and seed must generate the same tokens
+    float snapshot [dimension];
+    size_t first [20];
+    size_t second [20];
+
+    layer.SaveStream (snapshot);
+
+    std::mt19937 a (SEED);
+    layer.Generate (input, 20, first, a);
+
+    layer.RestoreStream (snapshot);
+
+    std::mt19937 b (SEED);
+    layer.Generate (input, 20, second, b);
+
+    std::cout << "generated:";
+    for (uint i = 0; i < 20; i++) std::cout << " " << first [i];
+    std::cout << "\nrestored stream matches: " << std::equal (first, first + 20, second) << std::endl;
+
+    // Sample frequencies against the distribution
+    const float weights [5] = {0.05, 0.4, 0.1, 0.25, 0.2};
+    AliasTable table (5);
+    table.Build (weights);
+
+    size_t counts [5] = {};
+    const size_t samples = 1000000;
+
+    for (uint i = 0; i < samples; i++) counts [table.Sample (generator)]++;
+
+    float worst = 0.0;
+    for (uint i = 0; i < 5; i++) worst = std::max (worst, std::fabs ((float)counts [i] / samples - weights [i]));
+
+    std::cout << "alias sampler: max frequency error " << worst << " over " << samples << " samples" << std::endl;
+};
+
+// Training memory and time of RecurrentLayer with gradient checkpointing at several intervals, against storing
+// every timestep, and the largest difference of the loss and weights from storing every timestep. 7 does not
+// divide timesteps, so the last segment is shorter. Then the same over chunks with a carried state
+void test_gradient_checkpointing ()
+{
+    std::mt19937 generator (SEED);
+    std::normal_distribution <float> distribution (0.0, 1.0);
+
+    const size_t timesteps = 256;
+    const size_t dimension = 32;
+    const size_t batch = 16;
+    const size_t length = batch * timesteps * dimension;
+
+    float* input = new float [length];
+    float* expected = new float [length]{};
+
+    for (uint i = 0; i < length; i++) input [i] = distribution (generator);
+    for (uint r = 0; r < batch * timesteps; r++) expected [r * dimension + r % dimension] = 1.0;
+
+    size_t dimensions [3] = {batch, timesteps, dimension};
+    Tensor <float, 3> input_batch (dimensions, input, 1);
+    Tensor <float, 3> expected_batch (dimensions, expected, 1);
+
+    // Largest difference between the weights of two layers
+    auto difference = [] (const RecurrentLayer <float>& a, const RecurrentLayer <float>& b)
+    {
+        float worst = 0.0;
+
+        for (uint j = 0; j < a.dimension * a.dimension; j++)
+        {
+            worst = std::max (worst, std::fabs (a.input_hidden_weights  -> elements [j] - b.input_hidden_weights  -> elements [j]));
+            worst = std::max (worst, std::fabs (a.hidden_hidden_weights -> elements [j] - b.hidden_hidden_weights -> elements [j]));
+            worst = std::max (worst, std::fabs (a.hidden_output_weights -> elements [j] - b.hidden_output_weights -> elements [j]));
+        };
+
+        return worst;
+    };
+
+    // Bytes of the buffers the layer has allocated: nine of timesteps rows per sequence for the batch, seven of
+    // interval rows plus the checkpoints and the carried delta per sequence for the segments, and the state
+    auto allocated = [] (const RecurrentLayer <float>& layer)
+    {
+        const size_t k = layer.checkpoint_interval;
+        const size_t segment_rows = (k == 0) ? 0 : 7 * k + (layer.timesteps + k - 1) / k + 1;
+        const size_t rows = layer.capacity * 9 * layer.timesteps + layer.segment_capacity * segment_rows + layer.state_capacity;
+
+        return rows * layer.dimension * sizeof (float);
+    };
+
+    // 0 stores every timestep, 16 is sqrt (timesteps)
+    const size_t intervals [5] = {0, 4, 7, 16, 64};
+
+    RecurrentLayer <float> reference (dimension, timesteps, 0.001);
+    float reference_loss = 0.0;
+
+    for (uint i = 0; i < 10; i++) reference_loss = reference.BackPropagate (input_batch, expected_batch);
+
+    for (size_t interval : intervals)
+    {
+        RecurrentLayer <float> layer (dimension, timesteps, 0.001);
+        if (interval > 0) layer.UseCheckpointing (interval);
+
+        float loss = 0.0;
+
+        const auto start = std::chrono::steady_clock::now ();
+        for (uint i = 0; i < 10; i++) loss = layer.BackPropagate (input_batch, expected_batch);
+        const auto end = std::chrono::steady_clock::now ();
+
+        std::cout << "interval " << interval << ": " << allocated (layer) / 1024 << " KiB, " << std::chrono::duration <double> (end - start).count () << " s, loss " << loss
+                  << ", differences: loss " << std::fabs (loss - reference_loss) << " weights " << difference (layer, reference) << std::endl;
+    };
+
+    // Chunks of 32 timesteps carrying the hidden state, with and without checkpointing
+    const size_t chunk = 32;
+    size_t chunk_dimensions [3] = {batch, chunk, dimension};
+
+    Tensor <float, 3> input_chunk (chunk_dimensions);
+    Tensor <float, 3> expected_chunk (chunk_dimensions);
+
+    RecurrentLayer <float> stored (dimension, chunk, 0.001);
+    RecurrentLayer <float> checkpointed (dimension, chunk, 0.001);
+
+    checkpointed.UseCheckpointing (5);
+
+    float loss_difference = 0.0;
+
+    for (uint c = 0; c < timesteps / chunk; c++)
+    {
+        for (uint b = 0; b < batch; b++)
+        {
+            const size_t offset = (b * timesteps + c * chunk) * dimension;
+
+            std::copy (input    + offset, input    + offset + chunk * dimension, input_chunk.elements    + b * chunk * dimension);
+            std::copy (expected + offset, expected + offset + chunk * dimension, expected_chunk.elements + b * chunk * dimension);
+        };
+
+        const float a = stored.BackPropagateChunk (input_chunk, expected_chunk);
+        const float b = checkpointed.BackPropagateChunk (input_chunk, expected_chunk);
+
+        loss_difference = std::max (loss_difference, std::fabs (a - b));
+    };
+
+    std::cout << "chunks of " << chunk << " with interval 5, differences: loss " << loss_difference << " weights " << difference (stored, checkpointed) << std::endl;
+
+    delete [] input;
+    delete [] expected;
+};
+
+// Variable-length sequences trained packed, against padding every sequence to the longest
+void test_jagged_sequences ()
+{
+    std::mt19937 generator (SEED);
+    std::uniform_int_distribution <size_t> length (5, 500);
+
+    const size_t count = 64;
+    const size_t dimension = 16;
+
+    size_t lengths [count];
+    size_t longest = 0;
+
+    for (uint i = 0; i < count; i++)
+    {
+        lengths [i] = (i == count / 2) ? 0 : length (generator);
+        longest = std::max (longest, lengths [i]);
+    };
+
+    // Each sequence counts through the classes from a different start, to be predicted one step ahead
+    JaggedTensor <float> input (lengths, count, dimension);
+    JaggedTensor <float> expected (lengths, count, dimension);
+
+    size_t padded_dimensions [3] = {count, longest, dimension};
+    Tensor <float, 3> padded_input (padded_dimensions);
+    Tensor <float, 3> padded_expected (padded_dimensions);
+
+    for (uint i = 0; i < count; i++)
+    {
+        for (uint t = 0; t < lengths [i]; t++)
+        {
+            input    [i][t * dimension + (i + t) % dimension] = 1.0;
+            expected [i][t * dimension + (i + t + 1) % dimension] = 1.0;
+
+            padded_input    .elements [(i * longest + t) * dimension + (i + t) % dimension] = 1.0;
+            padded_expected .elements [(i * longest + t) * dimension + (i + t + 1) % dimension] = 1.0;
+        };
+    };
+
+    PackedSequence <float> packed_input (input);
+    PackedSequence <float> packed_expected (expected);
+
+    RecurrentLayer <float> packed (dimension, 16, 0.0001);
+    RecurrentLayer <float> padded (dimension, longest, 0.0001);
+
+    double packed_time = 0.0;
+    double padded_time = 0.0;
+    float packed_loss = 0.0;
+    float padded_loss = 0.0;
+
+    for (uint epoch = 0; epoch < 10; epoch++)
+    {
+        auto start = std::chrono::steady_clock::now ();
+        packed_loss = packed.BackPropagate (packed_input, packed_expected);
+        auto end = std::chrono::steady_clock::now ();
+
+        packed_time += std::chrono::duration <double> (end - start).count ();
+
+        start = std::chrono::steady_clock::now ();
+        padded_loss = padded.BackPropagate (padded_input, padded_expected);
+        end = std::chrono::steady_clock::now ();
+
+        padded_time += std::chrono::duration <double> (end - start).count ();
+    };
+
+    std::cout << input.Steps () << " steps packed, " << count * longest << " padded" << std::endl;
+    std::cout << "packed: " << packed_time << " s, loss " << packed_loss << std::endl;
+    std::cout << "padded: " << padded_time << " s, loss " << padded_loss << std::endl;
+
+    // The packed probabilities, unpacked, against propagating each sequence alone with the same weights
+    JaggedTensor <float> probabilities (lengths, count, dimension);
+
+    packed.Propagate (packed_input);
+    packed_input.Unpack (packed.batch_probabilities, probabilities);
+
+    float difference = 0.0;
+
+    for (uint i = 0; i < count; i++)
+    {
+        if (lengths [i] == 0) continue;
+
+        RecurrentLayer <float> single (dimension, lengths [i]);
+
+        std::copy (packed.input_hidden_weights  -> elements, packed.input_hidden_weights  -> elements + dimension * dimension, single.input_hidden_weights  -> elements);
+        std::copy (packed.hidden_hidden_weights -> elements, packed.hidden_hidden_weights -> elements + dimension * dimension, single.hidden_hidden_weights -> elements);
+        std::copy (packed.hidden_output_weights -> elements, packed.hidden_output_weights -> elements + dimension * dimension, single.hidden_output_weights -> elements);
+        std::copy (packed.x_biases      -> elements, packed.x_biases      -> elements + dimension, single.x_biases      -> elements);
+        std::copy (packed.output_biases -> elements, packed.output_biases -> elements + dimension, single.output_biases -> elements);
+
+        size_t sequence_dimensions [2] = {lengths [i], dimension};
+        Tensor <float, 2> sequence (sequence_dimensions, input [i]);
+
+        single.Propagate (sequence);
+
+        for (uint j = 0; j < lengths [i] * dimension; j++)
+        {
+            difference = std::max (difference, std::fabs (probabilities [i][j] - single.probabilities -> elements [j]));
+        };
+    };
+
+    std::cout << "packed against each sequence alone: max difference " << difference << std::endl;
+};
+
+// Multi-head attention the direct way, in double, storing every score: the reference for the tiled layer
+void naive_attention (const MultiHeadAttentionLayer <float>& layer, const float* input, size_t length, double* output)
+{
+    const size_t D = layer.dimension;
+    const size_t width = layer.head_dimension;
+
+    double* q = new double [length * D];
+    double* k = new double [length * D];
+    double* v = new double [length * D];
+    double* a = new double [length * D]{};
+    double* scores = new double [length];
+
+    auto project = [&] (const float* weights, const double* x, bool single, double* y)
+    {
+        for (uint t = 0; t < length; t++)
+        {
+            for (uint o = 0; o < D; o++)
+            {
+                double total = 0.0;
+                for (uint i = 0; i < D; i++) total += weights [o * D + i] * (single ? input [t * D + i] : x [t * D + i]);
+                y [t * D + o] = total;
+            };
+        };
+    };
+
+    project (layer.query_weights -> elements, nullptr, true, q);
+    project (layer.key_weights   -> elements, nullptr, true, k);
+    project (layer.value_weights -> elements, nullptr, true, v);
+
+    for (uint h = 0; h < layer.heads; h++)
+    {
+        for (uint i = 0; i < length; i++)
+        {
+            const size_t last = layer.causal ? i : length - 1;
+            double maximum = -INFINITY;
+
+            for (uint j = 0; j <= last; j++)
+            {
+                double dot = 0.0;
+                for (uint c = 0; c < width; c++) dot += q [i * D + h * width + c] * k [j * D + h * width + c];
+
+                scores [j] = dot / std::sqrt ((double)width);
+                maximum = std::max (maximum, scores [j]);
+            };
+
+            double total = 0.0;
+
+            for (uint j = 0; j <= last; j++)
+            {
+                scores [j] = std::exp (scores [j] - maximum);
+                total += scores [j];
+            };
+
+            for (uint j = 0; j <= last; j++)
+            {
+                for (uint c = 0; c < width; c++) a [i * D + h * width + c] += scores [j] / total * v [j * D + h * width + c];
+            };
+        };
+    };
+
+    project (layer.output_weights -> elements, a, false, output);
+
+    delete [] q;
+    delete [] k;
+    delete [] v;
+    delete [] a;
+    delete [] scores;
+};
+
+void test_attention ()
+{
+    const size_t dimension = 64;
+    const size_t heads = 4;
+
+    ThreadPool pool (std::thread::hardware_concurrency ());
+
+    // The tiled layer against the naive one, with and without the causal mask. Blocks of 16 positions, so 7, 130 and
+    // 300 end in partial blocks. The gradients are checked against central differences of the naive mean squared
+    // error, at every seventh weight of each projection and every fifth input
+    for (bool causal : {false, true})
+    {
+        for (size_t length : {1, 7, 130, 300})
+        {
+            const size_t small = 16;
+
+            MultiHeadAttentionLayer <float> layer (small, 4, 0.0, causal);
+            layer.block = 16;
+            layer.UseThreads (&pool);
+
+            std::mt19937 generator (SEED);
+            std::normal_distribution <float> distribution;
+
+            size_t dimensions [2] = {length, small};
+            Tensor <float, 2> input (dimensions);
+            Tensor <float, 2> expected (dimensions);
+
+            for (uint i = 0; i < input.length; i++) input.elements [i] = distribution (generator);
+            for (uint i = 0; i < expected.length; i++) expected.elements [i] = distribution (generator);
+
+            double* reference = new double [length * small];
+            float* input_gradient = new float [length * small];
+
+            naive_attention (layer, input.elements, length, reference);
+            layer.Propagate (input);
+
+            double forward = 0.0;
+            for (uint i = 0; i < length * small; i++) forward = std::max (forward, std::fabs (reference [i] - layer.output [i]));
+
+            auto loss = [&] ()
+            {
+                naive_attention (layer, input.elements, length, reference);
+
+                double total = 0.0;
+
+                for (uint i = 0; i < length * small; i++)
+                {
+                    total += (expected.elements [i] - reference [i]) * (expected.elements [i] - reference [i]);
+                };
+
+                return total / (length * small);
+            };
+
+            auto difference = [&] (float* x)
+            {
+                const float h = 1e-3;
+                const float w = *x;
+
+                *x = w + h;
+                const double above = loss ();
+                *x = w - h;
+                const double below = loss ();
+                *x = w;
+
+                return (above - below) / (2 * h);
+            };
+
+            for (uint i = 0; i < length * small; i++)
+            {
+                layer.output_gradient [i] = - 2 * (expected.elements [i] - layer.output [i]) / (length * small);
+            };
+
+            layer.Backward (layer.output_gradient, input_gradient);
+
+            // Largest error relative to the largest gradient
+            double error = 0.0;
+            double largest = 0.0;
+
+            const std::pair <float*, const float*> parameters [4] = {
+                {layer.query_weights  -> elements, layer.query_weights_gradient},
+                {layer.key_weights    -> elements, layer.key_weights_gradient},
+                {layer.value_weights  -> elements, layer.value_weights_gradient},
+                {layer.output_weights -> elements, layer.output_weights_gradient}};
+
+            for (auto [weights, gradient] : parameters)
+            {
+                for (uint j = 0; j < small * small; j += 7)
+                {
+                    const double d = difference (weights + j);
+
+                    error = std::max (error, std::fabs (d - gradient [j]));
+                    largest = std::max (largest, std::fabs (d));
+                };
+            };
+
+            for (uint j = 0; j < length * small; j += 5)
+            {
+                const double d = difference (input.elements + j);
+
+                error = std::max (error, std::fabs (d - input_gradient [j]));
+                largest = std::max (largest, std::fabs (d));
+            };
+
+            std::cout << (causal ? "causal" : "full") << " length " << length << ": forward difference " << forward << ", gradient error " << error / largest << std::endl;
+
+            delete [] reference;
+            delete [] input_gradient;
+        };
+    };
+
+    // Learn to reproduce a random sequence of 128 positions
+    {
+        size_t dimensions [2] = {128, dimension};
+        Tensor <float, 2> input (dimensions);
+
+        std::mt19937 generator (SEED);
+        std::normal_distribution <float> distribution;
+
+        for (uint i = 0; i < input.length; i++) input.elements [i] = distribution (generator);
+
+        MultiHeadAttentionLayer <float> layer (dimension, heads, 0.5);
+        layer.UseThreads (&pool);
+
+        for (uint epoch = 0; epoch < 200; epoch++)
+        {
+            const float loss = layer.BackPropagate (input, input);
+
+            if (epoch % 50 == 0) std::cout << "epoch " << epoch << " loss " << loss << std::endl;
+        };
+    };
+
+    // Time and memory against length; a stored score matrix would need heads * length * length values
+    for (size_t length = 256; length <= 4096; length *= 2)
+    {
+        size_t dimensions [2] = {length, dimension};
+        Tensor <float, 2> input (dimensions);
+        Tensor <float, 2> expected (dimensions);
+
+        input.Randomise <std::normal_distribution <float>> ();
+        expected.Randomise <std::normal_distribution <float>> ();
+
+        MultiHeadAttentionLayer <float> layer (dimension, heads, 0.01, true);
+        layer.UseThreads (&pool);
+
+        auto start = std::chrono::steady_clock::now ();
+        layer.BackPropagate (input, expected);
+        auto end = std::chrono::steady_clock::now ();
+
+        const size_t bytes = (11 * length * dimension + 2 * heads * length) * sizeof (float);
+        const size_t scores = heads * length * length * sizeof (float);
+
+        std::cout << length << ": " << std::chrono::duration <double> (end - start).count () << " s, "
+                  << bytes / 1024 << " KiB buffers, " << scores / 1024 << " KiB of scores avoided" << std::endl;
+    };
+};
+
+void test_inference ()
+{
+    size_t dimensions [5] = {4, 10, 50, 10, 4};
+    ActivationType functions [4] = {relu, relu, relu, relu};
+
+    Network <4> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient);
+
+    const size_t size = 64;
+    float input [size][4];
+    float expected [size][4];
+
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    for (uint i = 0; i < size; i++)
+    {
+        for (uint j = 0; j < 4; j++)
+        {
+            input [i][j] = distribution (generator);
+        };
+
+        float* y = network.Propagate (input [i]);
+        std::copy (y, y + 4, expected [i]);
+    };
+
+    // One shared, const network serving several threads at once
+    const Network <4>& shared = network;
+    const uint threads = 4;
+    float errors [threads] = {};
+
+    std::thread workers [threads];
+
+    for (uint t = 0; t < threads; t++)
+    {
+        workers [t] = std::thread ([&, t] ()
+        {
+            float output [4];
+
+            for (uint i = t; i < 10000; i++)
+            {
+                shared.Infer (input [i % size], output);
+
+                for (uint j = 0; j < 4; j++)
+                {
+                    errors [t] = std::max (errors [t], std::fabs (output [j] - expected [i % size][j]));
+                };
+            };
+        });
+    };
+
+    for (uint t = 0; t < threads; t++)
+    {
+        workers [t].join ();
+        std::cout << "thread " << t << " max error: " << errors [t] << std::endl;
+    };
+};
+
+template <typename F>
+void measure_latency (const char* name, F f, uint repeats = 100000)
+{
+    double* times = new double [repeats];
+
+    for (uint i = 0; i < repeats; i++)
+    {
+        const auto start = std::chrono::steady_clock::now ();
+        f (i);
+        const auto end = std::chrono::steady_clock::now ();
+
+        times [i] = std::chrono::duration <double, std::nano> (end - start).count ();
+    };
+
+    std::sort (times, times + repeats);
+
+    std::cout << name << ": p50 " << times [repeats / 2] << " ns, p99 " << times [(repeats * 99) / 100] << " ns" << std::endl;
+
+    delete [] times;
+};
+
+void test_packed_inference ()
+{
+    size_t dimensions [5] = {4, 10, 50, 10, 4};
+    ActivationType functions [4] = {relu, relu, relu, relu};
+
+    Network <4> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient);
+    PackedNetwork <4> packed (network);
+    StaticNetwork <4, 10, 50, 10, 4> fixed (network);
+
+    const size_t size = 64;
+    float input [size][4];
+
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    for (uint i = 0; i < size; i++)
+    {
+        for (uint j = 0; j < 4; j++)
+        {
+            input [i][j] = distribution (generator);
+        };
+    };
+
+    float output [4];
+    InferenceScratch scratch;
+
+    // Packed and static against Network::Infer on every input
+    float packed_error = 0.0;
+    float static_error = 0.0;
+
+    for (uint i = 0; i < size; i++)
+    {
+        float reference [4];
+
+        network.Infer (input [i], reference, scratch);
+        packed.Infer (input [i], output, scratch);
+
+        for (uint j = 0; j < 4; j++) packed_error = std::max (packed_error, std::fabs (output [j] - reference [j]));
+
+        fixed.Infer (input [i], output);
+
+        for (uint j = 0; j < 4; j++) static_error = std::max (static_error, std::fabs (output [j] - reference [j]));
+    };
+
+    measure_latency ("Propagate", [&] (uint i) { network.Propagate (input [i % size]); });
+    measure_latency ("Infer",     [&] (uint i) { network.Infer (input [i % size], output, scratch); });
+    measure_latency ("Packed",    [&] (uint i) { packed.Infer (input [i % size], output, scratch); });
+    measure_latency ("Static",    [&] (uint i) { fixed.Infer (input [i % size], output); });
+
+    std::cout << "Packed max error: " << packed_error << std::endl;
+    std::cout << "Static max error: " << static_error << std::endl;
+};
+
+// Sum of every weight and bias, to compare training runs
+template <size_t depth>
+double parameter_sum (const Network <depth>& network)
+{
+    double sum = 0.0;
+
+    for (uint i = 0; i < depth; i++)
+    {
+        Layer <depth>* layer = network.layers [i];
+
+        for (uint j = 0; j < layer -> size.M * layer -> size.N; j++) sum += layer -> weights [0][j];
+        for (uint j = 0; j < layer -> size.M; j++) sum += layer -> biases [j];
+    };
+
+    return sum;
+};
+
+// Trains a fresh network on pool (serially if nullptr) and returns the sum of its parameters
+double train_data_parallel (ThreadPool* pool, float* input [], float* expected [], size_t size, float* costs [])
+{
+    size_t dimensions [5] = {4, 128, 256, 128, 4};
+    ActivationType functions [4] = {relu, relu, relu, relu};
+
+    Network <4> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient, 0.01, 0.01, 300, 0.5, 0.5, 1, SEED);
+    network.UseThreads (pool);
+
+    const auto start = std::chrono::steady_clock::now ();
+    *costs = network.GD_StochasticMomentum (input, expected, size, 64);
+    const auto end = std::chrono::steady_clock::now ();
+
+    std::cout << (pool ? pool -> size : 0) << " threads: " << std::chrono::duration <double> (end - start).count () << " s" << std::endl;
+
+    return parameter_sum (network);
+};
+
+void test_data_parallel ()
+{
+    const size_t size = 6400;
+    static float dummy [size][4];
+    float* input [size];
+    float* expected [size];
+
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    for (uint i = 0; i < size; i++) 
+    {
+        for (uint j = 0; j < 4; j++)
+        {
+            dummy [i][j] = distribution (generator);
+        };
+
+        input [i] = dummy [i];
+        expected [i] = new float [4];
+        test_function (input [i], expected [i]);
+    };
+
+    float* serial_costs;
+    train_data_parallel (nullptr, input, expected, size, &serial_costs);
+
+    // Bit-identical for every thread count, as the shards do not depend on it
+    float* reference = nullptr;
+    double reference_sum = 0.0;
+
+    for (uint threads = 1; threads <= std::max (4u, std::thread::hardware_concurrency ()); threads *= 2)
+    {
+        ThreadPool pool (threads);
+
+        float* costs;
+        const double sum = train_data_parallel (&pool, input, expected, size, &costs);
+
+        if (reference == nullptr)
+        {
+            reference = costs;
+            reference_sum = sum;
+            continue;
+        };
+
+        const bool identical = (sum == reference_sum) && std::equal (costs, costs + size / 64, reference);
+        std::cout << "    identical to 1 thread: " << identical << std::endl;
+
+        delete [] costs;
+    };
+
+    std::cout << "final cost serial " << serial_costs [size / 64 - 1] << ", parallel " << reference [size / 64 - 1] << std::endl;
+
+    delete [] serial_costs;
+    delete [] reference;
+
+    for (uint i = 0; i < size; i++)
+    {
+        delete [] expected [i];
+    };
+};
+
+// Mean loss over a data set, using the const inference path
+float evaluate (const Network <4>& network, float* input [], float* expected [], size_t size)
+{
+    float total = 0.0;
+    float output [4];
+
+    for (uint i = 0; i < size; i++)
+    {
+        network.Infer (input [i], output);
+        total += network.LossFunction (output, expected [i], 4);
+    };
+
+    return total / size;
+};
+
+// Convergence per wall-clock second of synchronous data-parallel minibatches against Hogwild, on the same pool
+void test_hogwild ()
+{
+    const size_t size = 6400;
+    static float dummy [size][4];
+    float* input [size];
+    float* expected [size];
+
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    for (uint i = 0; i < size; i++) 
+    {
+        for (uint j = 0; j < 4; j++)
+        {
+            dummy [i][j] = distribution (generator);
+        };
+
+        input [i] = dummy [i];
+        expected [i] = new float [4];
+        test_function (input [i], expected [i]);
+    };
+
+    size_t dimensions [5] = {4, 128, 256, 128, 4};
+    ActivationType functions [4] = {relu, relu, relu, relu};
+    ThreadPool pool (std::max (4u, std::thread::hardware_concurrency ()));
+
+    // Per-example updates take smaller steps than minibatch means
+    for (uint hogwild = 0; hogwild < 2; hogwild++)
+    {
+        Network <4> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient, 0.0, hogwild ? 0.0002 : 0.005, 100000, 0.5, 0.5, 1, SEED);
+        network.UseThreads (&pool);
+
+        double elapsed = 0.0;
+
+        for (uint epoch = 0; epoch < 5; epoch++)
+        {
+            const auto start = std::chrono::steady_clock::now ();
+            float* costs = hogwild ? network.GD_Hogwild (input, expected, size) : network.GD_Stochastic (input, expected, size, 64);
+            const auto end = std::chrono::steady_clock::now ();
+
+            elapsed += std::chrono::duration <double> (end - start).count ();
+            delete [] costs;
+
+            std::cout << (hogwild ? "hogwild" : "synchronous") << " epoch " << epoch << ": " << elapsed << " s, loss " << evaluate (network, input, expected, size) << std::endl;
+        };
+    };
+
+    for (uint i = 0; i < size; i++)
+    {
+        delete [] expected [i];
+    };
+};
+
+void test_pipeline ()
+{
+    const size_t size = 4096;
+    const size_t batch_size = 32;
+    static float dummy [size][4];
+    float* input [size];
+    float* expected [size];
+
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    for (uint i = 0; i < size; i++) 
+    {
+        for (uint j = 0; j < 4; j++)
+        {
+            dummy [i][j] = distribution (generator);
+        };
+
+        input [i] = dummy [i];
+        expected [i] = new float [4];
+        test_function (input [i], expected [i]);
+    };
+
+    size_t dimensions [9] = {4, 64, 64, 64, 64, 64, 64, 64, 4};
+    ActivationType functions [8] = {relu, relu, relu, relu, relu, relu, relu, relu};
+
+    double reference;
+    {
+        Network <8> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient, 0.01, 0.01, 300, 0.5, 0.5, 1, SEED);
+        delete [] network.GD_StochasticMomentum (input, expected, size, batch_size);
+        reference = parameter_sum (network);
+    };
+
+    for (uint stages = 1; stages <= 4; stages++)
+    {
+        Network <8> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient, 0.01, 0.01, 300, 0.5, 0.5, 1, SEED);
+        Pipeline <8> pipeline (network, stages, 8);
+
+        const auto start = std::chrono::steady_clock::now ();
+        delete [] pipeline.Train <Momentum> (input, expected, size, batch_size, network.momentum);
+        const auto end = std::chrono::steady_clock::now ();
+
+        // Same weights as serial training, whatever the number of stages
+        std::cout << stages << " stages: " << std::chrono::duration <double> (end - start).count () << " s, matches serial: " << (parameter_sum (network) == reference) << std::endl;
+    };
+
+    for (uint i = 0; i < size; i++)
+    {
+        delete [] expected [i];
+    };
+};
+
+// Forks ranks processes that train one replica each over the given transport; every rank prints its final
+// parameter sum, which should agree across ranks and across transports
+void test_distributed ()
+{
+    const size_t size = 6400;
+    const size_t batch_size = 64;
+    const size_t ranks = 3;
+    static float dummy [size][4];
+    float* input [size];
+    float* expected [size];
+
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    for (uint i = 0; i < size; i++) 
+    {
+        for (uint j = 0; j < 4; j++)
+        {
+            dummy [i][j] = distribution (generator);
+        };
+
+        input [i] = dummy [i];
+        expected [i] = new float [4];
+        test_function (input [i], expected [i]);
+    };
+
+    size_t dimensions [5] = {4, 128, 256, 128, 4};
+    ActivationType functions [4] = {relu, relu, relu, relu};
+
+    {
+        Network <4> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient, 0.01, 0.01, 300, 0.5, 0.5, 1, SEED);
+
+        const auto start = std::chrono::steady_clock::now ();
+        delete [] network.GD_StochasticMomentum (input, expected, size, batch_size);
+        const auto end = std::chrono::steady_clock::now ();
+
+        std::cout << "single process: " << std::chrono::duration <double> (end - start).count () << " s, sum " << parameter_sum (network) << std::endl;
+    };
+
+    for (uint shared = 0; shared < 2; shared++)
+    {
+        for (size_t rank = 0; rank < ranks; rank++)
+        {
+            if (fork () != 0) continue;
+
+            Transport* transport = shared 
+                ? (Transport*)new SharedMemoryTransport ("/ml_test_distributed", rank, ranks) 
+                : (Transport*)new SocketTransport ("/tmp/ml_test_distributed", rank, ranks);
+
+            Network <4> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient, 0.01, 0.01, 300, 0.5, 0.5, 1, SEED);
+
+            {
+                DistributedTrainer <4> trainer (network, *transport);
+
+                const auto start = std::chrono::steady_clock::now ();
+                delete [] trainer.Train <Momentum> (input, expected, size, batch_size, network.momentum);
+                const auto end = std::chrono::steady_clock::now ();
+
+                std::cout << (shared ? "shared memory" : "sockets") << " rank " << rank << ": " << std::chrono::duration <double> (end - start).count () << " s, sum " << parameter_sum (network) << std::endl;
+            };
+
+            delete transport;
+            exit (0);
+        };
+
+        while (wait (nullptr) > 0);
+    };
+
+    for (uint i = 0; i < size; i++)
+    {
+        delete [] expected [i];
+    };
+};
+
+// Distributed training with each gradient compressor at several rank counts; rank 0 reports the compression ratio,
+// overall and per layer, and the final loss. Compressed blocks are all-gathered, so the ratio falls as 1 / ranks
+// until a layer is cheaper to all-reduce uncompressed, and never drops below 1
+void test_gradient_compression ()
+{
+    const size_t size = 6400;
+    const size_t batch_size = 64;
+    const size_t rank_counts [4] = {2, 3, 4, 8};
+    static float dummy [size][4];
+    float* input [size];
+    float* expected [size];
+
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (0.0, 1.0);
+
+    for (uint i = 0; i < size; i++) 
+    {
+        for (uint j = 0; j < 4; j++)
+        {
+            dummy [i][j] = distribution (generator);
+        };
+
+        input [i] = dummy [i];
+        expected [i] = new float [4];
+        test_function (input [i], expected [i]);
+    };
+
+    size_t dimensions [5] = {4, 10, 50, 10, 4};
+    ActivationType functions [4] = {relu, relu, relu, relu};
+
+    // For some scales 127 / scale * scale rounds to just above 127, and adding a draw close to 1 then gives level 128,
+    // which wraps to -128 unless clamped. A large block of that scale draws enough times to hit it
+    {
+        float scale = 1.0;
+        while ((127 / scale) * scale <= 127) scale = std::nextafter (scale, 2.0f);
+
+        const size_t n = 1 << 20;
+        float* block = new float [n];
+        float* decoded = new float [n] ();
+        char* payload = new char [sizeof (float) + n];
+
+        std::fill (block, block + n, scale);
+
+        QuantisedCompressor quantiser (SEED);
+        quantiser.Compress (block, n, nullptr, payload);
+        quantiser.Decompress (payload, n, decoded);
+
+        std::cout << "8-bit smallest decoded value at scale " << scale << ": " << *std::min_element (decoded, decoded + n) << std::endl;
+
+        delete [] block;
+        delete [] decoded;
+        delete [] payload;
+    };
+
+    const char* names [4] = {"uncompressed", "top-k 10%", "top-k 1%", "8-bit"};
+
+    for (size_t ranks : rank_counts)
+    {
+        for (uint mode = 0; mode < 4; mode++)
+        {
+            for (size_t rank = 0; rank < ranks; rank++)
+            {
+                if (fork () != 0) continue;
+
+                Compressor* compressor = nullptr;
+                if (mode == 1) compressor = new TopKCompressor (0.1);
+                if (mode == 2) compressor = new TopKCompressor (0.01);
+                if (mode == 3) compressor = new QuantisedCompressor (SEED + rank);
+
+                const std::string name = "/ml_test_compression_" + std::to_string (mode) + "_" + std::to_string (ranks);
+                SharedMemoryTransport transport (name.c_str (), rank, ranks);
+
+                Network <4> network (dimensions, functions, Identity, MeanSquaredError, MeanSquaredErrorGradient, 0.01, 0.05, 300, 0.5, 0.5, 3, SEED);
+
+                {
+                    DistributedTrainer <4> trainer (network, transport, compressor);
+                    delete [] trainer.Train <Adam> (input, expected, size, batch_size, network.momentum, network.adam_decay_rate);
+
+                    if (rank == 0)
+                    {
+                        std::cout << ranks << " ranks, " << names [mode] << ": compression " << (float)trainer.uncompressed_bytes / trainer.sent_bytes 
+                                  << "x (layers";
+
+                        for (uint l = 0; l < 4; l++)
+                        {
+                            std::cout << " " << (float)trainer.layer_uncompressed_bytes [l] / trainer.layer_sent_bytes [l] << "x";
+                        };
+
+                        std::cout << "), loss " << evaluate (network, input, expected, size) << std::endl;
+                    };
+                };
+
+                delete compressor;
+                exit (0);
+            };
+
+            while (wait (nullptr) > 0);
+        };
+    };
+
+    for (uint i = 0; i < size; i++)
+    {
+        delete [] expected [i];
+    };
+};
+
+// Error in units in the last place of the float nearest the reference value
+double ulp_error (float y, double reference)
+{
+    const float r = std::fabs ((float)reference);
+    const double ulp = (double)std::nextafter (r, INFINITY) - (double)r;
+
+    return std::fabs ((double)y - reference) / ulp;
+};
+
+template <typename F, typename R>
+void measure_ulp (const char* name, float lower, float upper, F f, R reference, uint stride)
+{
+    double worst = 0.0;
+    float worst_x = lower;
+
+    for (float x = lower; x <= upper; )
+    {
+        const double error = ulp_error (f (x), reference ((double)x));
+
+        if (error > worst)
+        {
+            worst = error;
+            worst_x = x;
+        };
+
+        for (uint i = 0; i < stride; i++)
+        {
+            x = std::nextafter (x, INFINITY);
+        };
+    };
+
+    std::cout << name << ": max " << worst << " ulp at x = " << worst_x << std::endl;
+};
+
+void test_vmath ()
+{
+    // Visits every 16th float in each range; a stride of 3 reproduces the bounds documented in vmath.h
+    const uint stride = 16;
+
+    measure_ulp ("FastExp",     -87.0,   88.0,    FastExp,     [] (double x) { return exp (x); },           stride);
+    measure_ulp ("FastLog",     FLT_MIN, FLT_MAX, FastLog,     [] (double x) { return log (x); },           stride);
+    measure_ulp ("FastTanh",    -9.0,    9.0,     FastTanh,    [] (double x) { return tanh (x); },          stride);
+    measure_ulp ("FastSigmoid", -87.0,   87.0,    FastSigmoid, [] (double x) { return 1 / (1 + exp (-x)); }, stride);
+
+    // Throughput against libm, written to the benchmark profile
+    BenchmarkSession;
+
+    const size_t n = 1 << 20;
+    float* x = new float [n];
+    float* y = new float [n];
+
+    std::mt19937 generator (SEED);
+    std::uniform_real_distribution <float> distribution (-5.0, 5.0);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        x [i] = distribution (generator);
+    };
+
+    {
+        Timer timer ("libm tanh");
+        for (size_t i = 0; i < n; i++) y [i] = tanh (x [i]);
+    }
+    {
+        Timer timer ("TanhKernel");
+        TanhKernel (x, y, n);
+    }
+    {
+        Timer timer ("libm exp");
+        for (size_t i = 0; i < n; i++) y [i] = exp (x [i]);
+    }
+    {
+        Timer timer ("ExpKernel");
+        ExpKernel (x, y, n);
+    }
+
+    delete [] x;
+    delete [] y;
+};
+
 // ***---------  MAIN  ---------*** //
 
 int main () 
 {
+    // test_vmath ();
+    // test_inference ();
+    // test_packed_inference ();
+    // test_data_parallel ();
+    // test_hogwild ();
+    // test_pipeline ();
+    // test_distributed ();
+    // test_gradient_compression ();
     // test_size ();
     // test_benchmark ();
     // test_tensor ();
@@ -789,6 +2297,14 @@ int main ()
     // test_regression ();
     // test_convolve ();
     // test_convolution_layer ();
+    // test_batched_recurrent_layer ();
+    // test_gated_recurrent_layers ();
+    // test_recurrent_network ();
+    // test_truncated_bptt ();
+    // test_streaming ();
+    // test_gradient_checkpointing ();
+    // test_jagged_sequences ();
+    // test_attention ();
     test_recurrent_layer ();
     // run_net ();
 };
\ No newline at end of file
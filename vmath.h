@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cfloat>
+
+// ***---------  VECTOR MATHS  ---------*** //
+
+// Single precision approximations of exp, log, tanh and sigmoid built from range reduction and short
+// polynomials (Cephes coefficients). They are branchless, so loops calling them vectorise under
+// #pragma omp simd where the libm versions become one scalar call per element.
+//
+// Maximum error against a double precision reference, measured over every third float in the stated
+// range (see test_vmath in tests.cpp):
+//
+//     FastExp        x in [-87, 88]                       1.02 ULP
+//     FastLog        x in [FLT_MIN, FLT_MAX]              0.83 ULP
+//     FastTanh       x in [-9, 9]                         1.33 ULP
+//     FastSigmoid    x in [-87, 87]                       2.48 ULP
+//
+// Outside those ranges the functions saturate: FastExp clamps to [e^-87.3, e^88.7], FastTanh to +-1,
+// FastSigmoid to [0, 1] and FastLog treats inputs below FLT_MIN as FLT_MIN. NaN and infinity are not handled.
+
+inline float __as_float (int32_t i)
+{
+    float f;
+    std::memcpy (&f, &i, sizeof (f));
+    return f;
+};
+
+inline int32_t __as_int (float f)
+{
+    int32_t i;
+    std::memcpy (&i, &f, sizeof (i));
+    return i;
+};
+
+inline float FastExp (float x)
+{
+    x = std::fmin (std::fmax (x, -87.3365447f), 88.7228394f);
+
+    // x = n ln2 + r, |r| <= ln2 / 2, with ln2 split in two for an exact reduction
+    const float n = std::nearbyint (x * 1.44269504089f);
+    const float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+
+    const float y = p * r * r + r + 1;
+
+    // Multiply by 2^n in two halves so that n = 128 and n = -126 stay representable
+    const int32_t e = (int32_t)n;
+    const int32_t half = e / 2;
+
+    return y * __as_float ((half + 127) << 23) * __as_float ((e - half + 127) << 23);
+};
+
+inline float FastLog (float x)
+{
+    x = std::fmax (x, FLT_MIN);
+
+    // x = m 2^e with m in [sqrt(1/2), sqrt(2))
+    const int32_t bits = __as_int (x);
+    float e = (float)((bits >> 23) - 126);
+    float m = __as_float ((bits & 0x007fffff) | 0x3f000000); // [0.5, 1)
+
+    const bool small = m < 0.707106781186547524f;
+    e = small ? e - 1 : e;
+    m = small ? m + m - 1 : m - 1;
+
+    const float z = m * m;
+
+    float p = 7.0376836292e-2f;
+    p = p * m - 1.1514610310e-1f;
+    p = p * m + 1.1676998740e-1f;
+    p = p * m - 1.2420140846e-1f;
+    p = p * m + 1.4249322787e-1f;
+    p = p * m - 1.6668057665e-1f;
+    p = p * m + 2.0000714765e-1f;
+    p = p * m - 2.4999993993e-1f;
+    p = p * m + 3.3333331174e-1f;
+
+    float y = p * m * z;
+    y += e * -2.12194440e-4f;
+    y += -0.5f * z;
+
+    return m + y + e * 0.693359375f;
+};
+
+inline float FastTanh (float x)
+{
+    const float a = std::fabs (x);
+
+    // Small arguments: odd polynomial, avoids the cancellation in 1 - 2 / (e^2x + 1)
+    const float z = x * x;
+    float p = -5.70498872745e-3f;
+    p = p * z + 2.06390887954e-2f;
+    p = p * z - 5.37397155531e-2f;
+    p = p * z + 1.33314422036e-1f;
+    p = p * z - 3.33332819422e-1f;
+    const float near_zero = p * z * x + x;
+
+    const float far = std::copysign (1 - 2 / (FastExp (2 * std::fmin (a, 9.0f)) + 1), x);
+
+    return (a < 0.625f) ? near_zero : far;
+};
+
+inline float FastSigmoid (float x)
+{
+    return 1 / (1 + FastExp (-x));
+};
+
+// Array kernels
+inline void ExpKernel (const float* __restrict x, float* __restrict y, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) y [i] = FastExp (x [i]);
+};
+
+inline void LogKernel (const float* __restrict x, float* __restrict y, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) y [i] = FastLog (x [i]);
+};
+
+inline void TanhKernel (const float* __restrict x, float* __restrict y, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) y [i] = FastTanh (x [i]);
+};
+
+inline void SigmoidKernel (const float* __restrict x, float* __restrict y, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) y [i] = FastSigmoid (x [i]);
+};
+
+// Maths policies, passed as template parameters so that activation and loss code can opt in to the
+// approximations without a per-element branch
+struct StandardMath
+{
+    static float Exp   (float x) { return std::exp (x); };
+    static float Log   (float x) { return std::log (x); };
+    static float Log1p (float x) { return std::log1p (x); };
+    static float Tanh  (float x) { return std::tanh (x); };
+};
+
+struct FastMath
+{
+    static float Exp   (float x) { return FastExp (x); };
+    static float Log   (float x) { return FastLog (x); };
+    static float Log1p (float x) { return FastLog (1 + x); }; // absolute rather than relative accuracy near 0
+    static float Tanh  (float x) { return FastTanh (x); };
+};